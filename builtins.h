@@ -0,0 +1,43 @@
+/*
+ * builtins.h
+ * The list of djsh's built-in commands, shared by djsh.c and mkbuiltins.c.
+ * mkbuiltins searches for a seed that gives every name here its own slot under builtinNameHash(),
+ * writing the result to builtin_hash.h, so djsh can tell a built-in with one hash and one strcmp.
+ * The Makefile reruns it whenever this file changes.
+ */
+
+#include <stdint.h>
+
+// X(name, handler, fewest args, most args or -1 for no limit, changes the shell's state),
+// args not counting the name
+// One that changes (or reports on) the shell's state, such as cd or wait, has to run in the shell itself,
+// so when -j runs lines at once (batch or script mode) it waits for every line before it, while the rest
+// run alongside them
+#define DJSH_BUILTINS(X) \
+	X("exit", builtinExit, 0, 0, 1) \
+	X("cd", builtinCd, 1, 1, 1) \
+	X("path", builtinPath, 0, -1, 1) \
+	X("history", builtinHistory, 0, 2, 1) \
+	X("hash", builtinHash, 0, -1, 1) \
+	X("jobs", builtinJobs, 0, 0, 1) \
+	X("wait", builtinWait, 0, -1, 1) \
+	X("fg", builtinFg, 0, 1, 1) \
+	X("parallel", builtinParallel, 1, -1, 0) \
+	X("echo", builtinEcho, 0, -1, 0) \
+	X("printf", builtinPrintf, 1, -1, 0) \
+	X("test", builtinTest, 0, -1, 0) \
+	X("[", builtinTest, 1, -1, 0) \
+	X("true", builtinTrue, 0, -1, 0) \
+	X("false", builtinFalse, 0, -1, 0) \
+	X("pwd", builtinPwd, 0, 1, 0) \
+	X("cat", builtinCat, 0, -1, 0)
+
+// Seeded FNV-1a, with the high bits folded down since only the low ones pick the slot
+static inline uint32_t builtinNameHash(const char* name, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	for (int i=0; name[i] != '\0'; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h ^ (h >> 16);
+}
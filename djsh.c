@@ -3,26 +3,86 @@
  * Originally created March 2024
  * This program executes a limited linux shell.
  * The shell can perform some basic built-in commands as well as execute path commands.
- * Execute with ./djsh, which defaults to using execlp, or use ./djsh -execvp, to use execvp
+ * Execute with ./djsh, which defaults to using execlp, or use ./djsh -execvp, to use execvp,
+ * or use ./djsh -spawn to launch commands with posix_spawn instead of fork + exec
  * Built-in commands:
  *   exit:           exit djsh
  *   cd <arg1>:      change directory (".." to go up a directory)
  *   path:           print the current path variable
  *   path <arg1>:    overwrite the path variable with colon-separated path directories
- *   history:        print out recent inputs, up to 50
+ *   history:        print out recent inputs, up to $HISTSIZE (default 50)
  *   history <arg1>: specify the number of recent inputs to print
+ *   history -s <pattern>: print the inputs containing pattern (starting with it if it begins with ^)
+ *   history -r <pattern>: print only the most recent input matching pattern
+ *   hash:           print the remembered command locations
+ *   hash <arg1>:    look up a command and remember its location
+ *   hash -p <path> <name>: remember <path> as the location of <name>
+ *   hash -r:        forget all remembered locations
+ *   jobs:           list the background jobs
+ *   wait:           wait for every background job, or wait n for just job n
+ *   fg:             wait for the most recent background job, or fg n for job n
+ *   parallel -j n -k -l cmd {} ::: args: run cmd once per arg, with the arg in place of {} (or added
+ *                   on the end), n at a time (default one per CPU), reporting each one as it finishes
+ *                   (or in order with -k); without ::: the args are read from stdin, one per line
+ *   echo, printf, test/[, true, false, pwd: as in coreutils, without starting a process
+ *   cat <files>:    write out the files (or stdin) without starting a process, copying in the kernel
+ * History is saved to $HISTFILE (default ~/.djsh_history, empty to turn off)
+ * Set DJSH_SHARED_HISTORY to a shared memory name to share history live with other sessions
+ * Inputs can refer back to history: !! is the last input, !n the n-th one listed by history,
+ * !-n the n-th most recent, and !prefix the most recent starting with prefix
+ * Commands can be chained with |, each one's output becoming the next one's input
+ * Each command's fds can be redirected, in order from left to right (with or without a space
+ * before the file, eg 2>/dev/null):
+ *   < file, > file, >> file: read from, write to or append to file (n<, n>, n>> for fd n)
+ *   n>&m, n<&m: make fd n a copy of fd m (eg 2>&1)
+ *   <<word: read the lines that follow, up to one that's just word, as stdin
+ *   <<< word: use word (and a newline) as stdin
+ * Ending a line with & runs it in the background as a job
+ * Started with -j n and given input that isn't a terminal, djsh runs up to n lines at once,
+ *   writing out each line's output in input order
+ *   Output of commands run side by side is collected and written out a whole job at a time,
+ *   or with -l a whole line at a time with [job number] in front
+ *   A built-in that changes the shell (such as cd or wait) first waits for every line before it
+ *   Batch lines aren't added to history or expanded
+ * ./djsh script (or a script starting with a #! line naming djsh) runs the script's lines, # starting
+ *   a comment, with its parsed form cached in $DJSH_SCRIPT_CACHE (default ~/.cache/djsh, empty to turn
+ *   off) so it's only parsed again once its path, mtime or size changes
+ *   djsh then waits for any background ones and exits with 1 if any of the script's commands failed
  */
 
+#define _GNU_SOURCE  // for O_PATH and getdents64
 #include <stdio.h>
+#include <stdio_ext.h>
+#include <spawn.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include "builtins.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define MAX_ARGS 4 // NOTE: changing this will require changing execlp() below
+#define EXECLP_ARGS 4 // NOTE: changing this will require changing execlp() below
 
 // Return the command without its path, eg "/bin/ls" returns "ls"
 char* getCommandFromPath(char* cmdPath);
@@ -30,17 +90,825 @@ char* getCommandFromPath(char* cmdPath);
 // Print the one and only error message
 void djsh_error();
 
-// Check for the current command along Path and current directory
-// Return the first path found (including the command)
-char* checkPath(char* cmd, char* path);
+// Split line in place on whitespace into *tokens, growing it (and *maxTokens) as needed
+// *tokens always has room for a NULL after the last token
+// Return the number of tokens on the line
+int tokenizeLine(char* line, char*** tokens, int* maxTokens);
 
-// Node for singly-linked list containing command history
-// Head is oldest, Tail is newest
-struct HistEntry {
-	char* cmd;  // The command to be stored
-	struct HistEntry* next;  // Pointer to the next most entry
+// Return 1 if args plus the environment would be too big for the kernel to exec (ARG_MAX)
+int argsTooLong(char* args[]);
+
+// Return 1 if c separates tokens (same set strtok was given)
+int isWhiteSpace(char c);
+
+// Return the first byte from c up to end that is (or with skipping=1, isn't) whitespace
+// Works through the line 16 or 32 bytes at a time where SSE2 or AVX2 is available
+// Return end if there is none
+char* scanWhiteSpace(char* c, char* end, int skipping);
+
+// Return 1 if cmd is handled by djsh itself rather than run from the path
+int isBuiltin(char* cmd);
+
+// Return 1 if cmd is a built-in that changes (or reports on) the shell's own state, such as cd or wait
+int changesShellState(char* cmd);
+
+// One redirection of a command's fds
+struct Redirect {
+	char* op;  // The operator as written, eg ">>" or "2>&1"
+	int fd;  // The fd being redirected
+	char* filename;  // File to open onto fd, or NULL to copy dupFd onto it instead
+	int flags;  // open flags for filename
+	int dupFd;
+	int savedFd;  // fd's original while a built-in's redirection is in effect, -1 if it wasn't open
+	char hereType;  // 'd' for a here-document (<<), 's' for a here-string (<<<), 0 for neither
+	char* here;  // The here-document's delimiter, or the here-string itself
+	char* body;  // The here-document's body if it's already known (in a script), NULL to read it from the input
+};
+
+// One command in a pipeline
+struct Stage {
+	char** args;  // The command and its arguments, NULL-terminated
+	struct Redirect* redirects;  // Applied in order once its pipes are hooked up
+	int numRedirects;
+};
+
+// A line split up into its pipeline, with room to reuse for the next line
+struct ParsedLine {
+	char** tokens;  // Every token on the line, each one a slice of the line
+	int maxTokens;  // How many tokens there's currently room for
+	struct Stage* stages;  // The commands on the line, split on "|"
+	int maxStages;
+	int numStages;
+	struct Redirect* redirects;  // Every stage's redirections, one after another
+	int maxRedirects;
+	int background;  // 1 if the line ends with &
+};
+
+// Launch cmdPath with posix_spawn, with inFd, outFd and errFd as its stdin, stdout and stderr
+// (-1 to leave any alone), then applying its redirections
+// Return the child's pid, or -1 if it couldn't be launched
+pid_t spawnCommand(char* cmdPath, char* args[], int inFd, int outFd, int errFd, struct Stage* stage);
+
+// Split line in place into the stages of a pipeline, keeping everything in parsed
+// Return how many stages there are, or -1 if the line can't be run
+int parseLine(char* line, struct ParsedLine* parsed);
+
+// Fill in r if token is a redirection operator (maybe with its filename or here word stuck on)
+// Return 0 if it isn't one, 1 if it needs a filename to follow, 2 if it's complete, or -1 if it
+// starts like one but isn't (eg >&file)
+int parseRedirect(char* token, struct Redirect* r);
+
+// Read the body of every here-document on parsed's line from in (unless it already has one),
+// and put each here-document and here-string into a memfd for its command to read from
+// Return -1 if one couldn't be made
+int prepareHereDocs(struct ParsedLine* parsed, FILE* in);
+
+// Return the token that followed r's operator (its filename or here word), or NULL if there wasn't one
+char* redirectWord(struct Redirect* r);
+
+// Close the memfds made by prepareHereDocs, once the commands have their own copies
+void closeHereDocs(struct ParsedLine* parsed);
+
+// Apply the numRedirects redirections in r to this process, saving what they replace if save is set
+// Return -1 if any of them failed, having undone any saved ones already applied
+int applyRedirects(struct Redirect r[], int numRedirects, int save);
+
+// Put back the fds saved by applyRedirects
+void restoreRedirects(struct Redirect r[], int numRedirects);
+
+// Run the built-in command args[0] in this process, after checking how many arguments it got
+// Return its exit status
+int runBuiltin(char* args[]);
+
+// Run a built-in that's alone on its line in this process, with its redirections
+// in effect just while it runs
+// Return its exit status
+int runLoneBuiltin(struct Stage* stage);
+
+// Start every stage of a pipeline, each one's stdout piped into the next one's stdin,
+// then wait for all of them, or if background then leave them running as a job
+// Return the last stage's exit status (128 + the signal if one killed it), or 0 if background
+int runPipeline(struct Stage stages[], int numStages, int background);
+
+// Start every stage of a pipeline, with the last one's stdout going to outFd and every one's
+// stderr going to errFd (-1 to leave either alone)
+// Fill in pids with each stage's pid, -1 for any that couldn't be started
+void startPipeline(struct Stage stages[], int numStages, int outFd, int errFd, pid_t pids[]);
+
+// Start stage with inFd, outFd and errFd as its stdin, stdout and stderr (-1 to leave any alone)
+// Return the child's pid, or -1 if it couldn't be started
+pid_t launchStage(struct Stage* stage, int inFd, int outFd, int errFd);
+
+// In a freshly forked child, point stdin, stdout and stderr at inFd, outFd and errFd (-1 to
+// leave any alone), then apply stage's redirections
+// Return -1 if any of it failed
+int setupChildFds(int inFd, int outFd, int errFd, struct Stage* stage);
+
+// A built-in command, its name and arity coming from builtins.h
+struct Builtin {
+	const char* name;
+	int (*handler)(char* args[]);  // Given the full argument list, returns the exit status
+	int minArgs;  // Fewest arguments after the name
+	int maxArgs;  // Most arguments after the name, -1 for no limit
+	int changesState;  // 1 if it changes (or reports on) the shell's state, so can't run in a child
+};
+
+// The built-ins' handlers, each given its full argument list and returning its exit status
+int builtinExit(char* args[]);
+int builtinCd(char* args[]);
+int builtinPath(char* args[]);
+int builtinHistory(char* args[]);
+int builtinHash(char* args[]);
+int builtinJobs(char* args[]);
+int builtinWait(char* args[]);
+int builtinFg(char* args[]);
+int builtinParallel(char* args[]);
+int builtinEcho(char* args[]);
+int builtinPrintf(char* args[]);
+int builtinTest(char* args[]);
+int builtinTrue(char* args[]);
+int builtinFalse(char* args[]);
+int builtinPwd(char* args[]);
+int builtinCat(char* args[]);
+
+// Every built-in, in the order builtins.h lists them so builtin_hash.h's indexes match
+const struct Builtin builtins[] = {
+#define BUILTIN(name, handler, minArgs, maxArgs, changesState) {name, handler, minArgs, maxArgs, changesState},
+	DJSH_BUILTINS(BUILTIN)
+#undef BUILTIN
+};
+#include "builtin_hash.h"
+
+// Return the built-in called name, or NULL if there isn't one
+const struct Builtin* findBuiltin(char* name);
+
+// Write the escape sequence *s points at (just past its backslash) to stdout and move *s past it,
+// with octal written \0nnn like echo and %b if echoStyle, or \nnn like a printf format if not
+// Return 1 if it was \c, meaning nothing more should be written
+int putEscape(char** s, int echoStyle);
+
+// Write every character of str to stdout, expanding escapes echo-style
+// Return 1 if it hit \c, meaning nothing more should be written
+int putEscaped(char* str);
+
+// Write out printf's format once, taking the values for its conversions from *args (moving it
+// past each one used), and set *status to 1 if any of them was bad
+// Return 1 if writing should stop there (\c or a bad conversion)
+int printfFormat(char* format, char*** args, int* status);
+
+// Return the number arg (NULL being 0, and 'c or "c being c's code) for a printf conversion,
+// setting *status to 1 if it isn't one
+long long printfInt(char* arg, int* status);
+long double printfFloat(char* arg, int* status);
+
+// The arguments of a test being evaluated, how far through them it's got, and whether they
+// turned out not to make sense
+struct TestState {
+	char** args;
+	int pos;
+	int end;
+	int error;
+};
+
+// Evaluate the numArgs arguments of test, applying the POSIX rules for four or fewer
+// before falling back on the full grammar
+int testArgs(struct TestState* t, char** args, int numArgs);
+
+// Evaluate t's arguments from t->pos on, as an expression of -o, -a, !, ( ) and primaries
+int testOr(struct TestState* t);
+int testAnd(struct TestState* t);
+int testNot(struct TestState* t);
+int testPrimary(struct TestState* t);
+
+// Return whether op is one of test's unary (-f, -n, ...) or binary (=, -eq, -nt, ...) operators
+int isTestUnary(char* op);
+int isTestBinary(char* op);
+
+// Evaluate test's unary op on arg, or its binary op on left and right, setting t->error if
+// they don't make sense
+int testUnary(struct TestState* t, char* op, char* arg);
+int testBinary(struct TestState* t, char* left, char* op, char* right);
+
+// Parse arg as one of test's integers, setting t->error if it isn't one
+long long testInt(struct TestState* t, char* arg);
+
+// Copy everything left in inFd to outFd, keeping the data in the kernel where the fd types allow
+// Return -1 if reading or writing failed
+int catFd(int inFd, int outFd);
+
+// Run the command args[0] from the path rather than as a built-in, with this process's fds,
+// and wait for it
+// Return its exit status
+int runExternal(char* args[]);
+
+// A background job: the processes of one pipeline started with &
+struct Job {
+	char* line;  // The pipeline as typed, NULL if this slot is free
+	pid_t* pids;  // Every stage's pid, -1 once reaped (or if it never started)
+	int* pidfds;  // A pidfd for each stage still running, or -1
+	int numPids;
+	int numRunning;  // Stages not yet reaped
+	int status;  // The last stage's wait status
+	int id;  // The number it's reported under
+	long seq;  // Order it was started in among background jobs, the most recent being highest
+	struct JobOutput* output;  // Its collected output, or NULL if it goes straight to stdout
+};
+
+// Bytes of a job's stream kept in memory before the rest spills to a memfd
+#define OUTPUT_BUFFER_MAX 65536
+// Marks the epoll events for a job's output pipes, the low bit being which stream
+#define OUTPUT_TAG 0x80000000u
+
+// Output collected from one of a job's pipes
+struct OutputStream {
+	int fd;  // Read end of the pipe, -1 once it has hit end of file
+	char* data;  // Collected but not yet written out
+	size_t len;
+	size_t cap;
+	int spillFd;  // memfd holding what came after data filled up, or -1
+	off_t spillLen;
+};
+
+// Output collected from a job's stdout and stderr
+struct JobOutput {
+	struct OutputStream streams[2];
+	int id;  // Number put in front of each line in line mode
+	int lineMode;  // 1 to write out each line as soon as it's complete, 0 to hold it all until asked
+};
+
+// Jobs run a limited number at a time, their output written out as they finish or in the order
+// they were started
+struct JobPool {
+	struct Job* ring;  // NULL line for a free slot
+	int size;  // Slots in ring, which limits how many jobs can wait to be written out
+	int head;  // With inOrder, ring[head] is the oldest job not yet written out
+	int numQueued;  // Jobs started but not yet written out
+	int maxRunning;
+	int inOrder;
+	int lineMode;
+	int report;  // 1 to print each job's exit status after its output
+	int numFailed;
+	int nextId;
+	int epollFd;  // Every queued job's pidfds and output pipes
+};
+
+// Most jobs a pool runs at once, however many fds there are to spare
+#define POOL_MAX_RUNNING 4096
+// Each running job holds a pidfd and the read ends of two pipes
+#define POOL_FDS_PER_JOB 3
+// Fds left over for the shell itself (path directories, epoll sets, history) and for pipelines' pipes
+#define POOL_FDS_RESERVED 64
+// How often (in ms) processes without a pidfd are checked on while waiting
+#define JOB_RECHECK_MS 10
+
+// Background jobs, a job's number being its slot + 1
+struct Job* jobs = NULL;
+int maxJobs = 0;
+long numJobsStarted = 0;  // Background jobs ever started, giving each its seq
+// Every running job's pidfds, each one readable once its process exits,
+// with the job's slot in the high half of the event data and the stage in the low half
+int jobEpollFd = -1;
+// Waits on stdin and jobEpollFd together, so finished jobs are reaped right away
+// even while sitting at the prompt
+int promptEpollFd = -1;
+// 0 while running a script, whose output is just its commands' own, so jobs aren't announced
+int announceJobs = 1;
+// Jobs that have been waited for or reported having failed, which a script's exit status counts
+int numJobsFailed = 0;
+// 1 while runScript runs a script's lines, so exit only stops the script, letting runScript
+// wait for its jobs and work out its exit status
+int runningScript = 0;
+int scriptExited = 0;  // Set by exit while running a script
+
+// Set up the epoll instances used to notice jobs finishing
+void jobsInit();
+
+// Record pids as a new background job and announce it (if announceJobs), unless none of them started
+void jobAdd(struct Stage stages[], int numStages, pid_t pids[]);
+
+// Fill in job with the numPids processes in pids, adding a pidfd for each to epollFd
+// tagged with slot, so it's noticed when they exit
+void jobWatch(struct Job* job, pid_t pids[], int numPids, int epollFd, int slot);
+
+// Reap stage of job if it has exited (or isn't a child of this process), waiting for it if block is set
+void jobReap(struct Job* job, int stage, int block, int epollFd);
+
+// Reap whatever has finished, waiting up to timeout ms (-1 for forever) for something to
+void jobsPoll(int timeout);
+
+// Reap whatever has finished out of the numSlots jobs in table watched by epollFd,
+// waiting up to timeout ms (-1 for forever) for something to
+void jobTablePoll(struct Job table[], int numSlots, int epollFd, int timeout);
+
+// Free job's memory and mark it free
+void jobFree(struct Job* job);
+
+// Return 1 if job's processes are all reaped and its output pipes all drained
+int jobDone(struct Job* job);
+
+// Make the pipes for a job's output, putting their write ends in writeFds
+// Return NULL if they couldn't be made
+struct JobOutput* outputCreate(int id, int lineMode, int writeFds[2]);
+
+// Read what's waiting in stream of out, writing any complete lines straight out in line mode
+void outputRead(struct JobOutput* out, int stream, int epollFd);
+
+// Add n bytes of data to the end of stream, spilling to a memfd past OUTPUT_BUFFER_MAX
+void outputAppend(struct OutputStream* stream, const char* data, size_t n);
+
+// Write everything collected in stream to fd and empty it
+void outputWriteStream(struct OutputStream* stream, int fd);
+
+// Close and free everything of out
+void outputFree(struct JobOutput* out);
+
+// Write all n bytes of data to fd
+void writeAll(int fd, const char* data, size_t n);
+
+// Copy size bytes from the start of fromFd to toFd
+void copyFdOut(int toFd, int fromFd, off_t size);
+
+// Set up pool to run up to maxRunning jobs at once (no more than POOL_MAX_RUNNING, or than the
+// open file limit leaves fds for)
+// Return -1 if there wasn't the memory for it
+int poolInit(struct JobPool* pool, int maxRunning, int inOrder, int lineMode, int report);
+
+// Start a pipeline as a job of pool, waiting for room first, the job taking ownership of line
+void poolStart(struct JobPool* pool, struct Stage stages[], int numStages, char* line);
+
+// Write out pool's finished jobs, waiting on unfinished ones until no more than maxQueued are left
+void poolFlush(struct JobPool* pool, int maxQueued);
+
+// Write out job's collected output and status, then free it
+void poolFinish(struct JobPool* pool, struct Job* job);
+
+// Run every line of stdin, up to maxRunning at a time, writing each one's output in input order
+// or, with lineMode, line by line as it comes
+void runBatch(int maxRunning, int lineMode);
+
+// Changed whenever the layout of a compiled script does, so old caches are just recompiled
+#define SCRIPT_CACHE_MAGIC "djshsc01"
+#define NO_STRING UINT32_MAX
+
+// The start of a compiled script, as cached on disk, followed by its commands, stages, args,
+// redirections and strings, everything referring to a string by its offset into the strings
+struct ScriptCacheHeader {
+	char magic[8];
+	int64_t mtimeSec;  // The script's mtime and size when it was compiled
+	int64_t mtimeNsec;
+	int64_t size;
+	uint32_t pathLen;  // The script's full path is the first of the strings
+	uint32_t numCommands;
+	uint32_t numStages;
+	uint32_t numArgs;
+	uint32_t numRedirects;
+	uint32_t stringsSize;
+};
+struct CachedCommand {
+	uint32_t line;
+	uint32_t firstStage;
+	uint32_t numStages;  // 0 if the line couldn't be parsed
+	uint32_t background;
+};
+struct CachedStage {
+	uint32_t firstArg;  // Its args run up to the next NO_STRING
+	uint32_t firstRedirect;
+	uint32_t numRedirects;
+};
+struct CachedRedirect {
+	uint32_t op;
+	uint32_t filename;
+	uint32_t here;
+	uint32_t body;
+	int32_t fd;
+	int32_t flags;
+	int32_t dupFd;
+	int32_t hereType;
+};
+
+// A compiled script while it's being built up, each part growing as lines are added
+struct ScriptBuilder {
+	struct CachedCommand* commands;
+	int numCommands, maxCommands;
+	struct CachedStage* stages;
+	int numStages, maxStages;
+	uint32_t* args;
+	int numArgs, maxArgs;
+	struct CachedRedirect* redirects;
+	int numRedirects, maxRedirects;
+	char* strings;
+	int stringsSize, maxStrings;
+};
+
+// One line of a script, ready to run
+struct ScriptCommand {
+	char* line;  // As written, for describing it as a job
+	struct Stage* stages;  // Its redirections are one after another, like a ParsedLine's
+	int numStages;  // 0 if the line couldn't be parsed
+	int background;
+};
+
+// Run every command of the script at scriptPath, up to maxRunning at a time if that's more than 0,
+// using its cached compiled form if the script hasn't changed since
+// Return -1 if it couldn't be read, 1 if any of its commands failed, or 0
+int runScript(char* scriptPath, int maxRunning, int lineMode);
+
+// Return where the compiled form of the script at realPath is cached (malloc'd),
+// or NULL if $DJSH_SCRIPT_CACHE is set empty to turn caching off
+char* scriptCachePath(char* realPath);
+
+// Map the compiled script at cachePath if it was compiled from realPath as st describes it now
+// Return NULL (a miss) if it wasn't, or can't be used
+char* scriptCacheLoad(char* cachePath, char* realPath, struct stat* st, size_t* imageSize);
+
+// Write the compiled script image to cachePath, replacing whatever was there in one go
+void scriptCacheSave(char* cachePath, char* image, size_t imageSize);
+
+// Parse the dataSize bytes of the script at realPath (described by st) into a compiled image
+// Return the image (malloc'd), setting imageSize
+char* compileScript(char* data, size_t dataSize, char* realPath, struct stat* st, size_t* imageSize);
+
+// Return the strings of the compiled script image if the sizes in its header add up, or NULL
+char* scriptStrings(char* image, size_t imageSize);
+
+// Point commands at the commands of the compiled script image, setting numCommands
+// Return -1 if the image doesn't make sense
+int loadScript(char* image, size_t imageSize, struct ScriptCommand** commands, int* numCommands);
+
+// Return the line of data starting at *pos without its line ending, setting len and moving *pos
+// to the next one, or NULL at the end
+char* scriptNextLine(char* data, size_t dataSize, size_t* pos, size_t* len);
+
+// Add len bytes of data to b's strings
+// Return where they start
+uint32_t scriptAddBytes(struct ScriptBuilder* b, const char* data, size_t len);
+
+// Make sure array (of elements size bytes each) has room for needed of them, doubling *max as needed
+// Return the array, moved if it had to grow
+void* growArray(void* array, int* max, int needed, size_t size);
+
+// Print and free every finished job, starting on a fresh line if atPrompt
+// Return how many there were
+int jobsNotify(int atPrompt);
+
+// Block until job slot has finished then free it, or every job if slot is -1
+void jobsWait(int slot);
+
+// Turn the job number arg (NULL for the most recent job) into a slot of a live job
+// Return -1 if there's no such job
+int jobSlot(char* arg);
+
+// Print the prompt then wait until a line can be read, reporting jobs that finish meanwhile
+void waitForInput(const char* prompt);
+
+// Print how job number id (described by what) ended, given its wait status
+void printStatus(int id, int status, char* what);
+
+// Run the parallel builtin, args being its full argument list
+// Return 1 if any of the runs failed
+int runParallel(char* args[]);
+
+// Return word with every {} replaced by input, or word itself if it has no {}
+char* substituteArg(char* word, char* input);
+
+char execType = 'l';  // 'l' for execlp, 'v' for execvp, 's' for posix_spawn
+int stdinRedirected = 0;  // 1 while a built-in's stdin is redirected away from the shell's input
+char* path = NULL;  // The colon-separated search path, as set by the path builtin
+
+extern char** environ;
+
+// Check for the current command in each of the path's directories
+// Return the first path found (including the command), or NULL if none
+char* checkPath(char* cmd);
+
+// A directory from the path, opened once so lookups don't re-walk its name
+struct PathDir {
+	char* name;  // The directory as written in the path
+	int fd;  // O_PATH fd for the directory, or -1 if it isn't open (yet)
+	struct timespec mtime;  // The directory's mtime when the index read it, zero if it couldn't be read
+};
+
+// Split path on colons into pathDirs and open each directory
+void setPathDirs(char* path);
+
+// Close the directories named relative to the current directory, since a cd changes them
+// Return 1 if any were closed
+int closeRelativePathDirs();
+
+// The path's directories, in search order
+struct PathDir* pathDirs = NULL;
+int numPathDirs = 0;
+
+// Number of buckets in the index of path executables
+#define INDEX_BUCKETS 4096
+
+// Node for the index of every executable in the path's directories
+// Each bucket is a singly-linked list of entries
+struct IndexEntry {
+	char* name;  // The executable's file name
+	int dir;  // Index into pathDirs of the first directory holding it
+	struct IndexEntry* next;  // Pointer to the next entry in the bucket
+};
+
+// Rebuild the index from the path's directories and watch them for changes
+// Return 1 if the index can be trusted, or 0 if lookups must search the directories
+int buildPathIndex();
+
+// Drop the index if inotify reports a change in any of the path's directories
+void syncPathIndex();
+
+// Return 1 if any of the path's directories has a different mtime than when the index read it,
+// or has turned up since, which catches what inotify can't see (eg changes from other NFS clients)
+// Only looks once every PATH_RECHECK_MS, returning 0 in between, so misses stay free of syscalls
+int pathDirsChanged();
+
+// Return 1 if name in the directory dirFd is a regular file (following links) that can be executed,
+// with type being its d_type from getdents64 (DT_UNKNOWN if not known)
+int isExecutable(int dirFd, char* name, unsigned char type);
+
+// Return the index's entry for cmd, or NULL if it isn't there
+struct IndexEntry* pathIndexFind(char* cmd);
+
+// Forget the index so it's rebuilt on the next lookup
+void invalidatePathIndex();
+
+// The index itself, which is only trusted while indexValid is 1
+struct IndexEntry* pathIndex[INDEX_BUCKETS] = {NULL};
+int indexValid = 0;
+int indexFailed = 0;  // 1 if the index couldn't be built for the current path
+int inotifyFd = -1;  // Watches every directory in the index
+// How often (in ms) a miss may look at the path's directories' mtimes
+#define PATH_RECHECK_MS 1000
+struct timespec pathCheckedAt = {0};  // When the mtimes were last read (CLOCK_MONOTONIC)
+
+// Number of buckets in the command hash table
+#define HASH_BUCKETS 64
+
+// Node for the command hash table, mapping a command name to its resolved path
+// Each bucket is a singly-linked list of entries
+struct HashEntry {
+	char* name;  // The command as it was typed
+	char* cmdPath;  // The path it resolved to
+	int hits;  // Number of times this entry has been used
+	int pinned;  // 1 if set with "hash -p" (survives path changes)
+	struct HashEntry* next;  // Pointer to the next entry in the bucket
+};
+
+// Return the djb2 hash of str
+unsigned int hashString(char* str);
+
+// Return the remembered path for cmd, resolving (and remembering) it first if needed
+// Return NULL if the command can't be found
+char* hashLookup(char* cmd);
+
+// Remember cmdPath as the location of name, replacing any previous entry
+void hashInsert(char* name, char* cmdPath, int pinned);
+
+// Forget remembered locations (pinned ones too if keepPinned is 0)
+void hashClear(int keepPinned);
+
+// Print every remembered location along with its hit count and name
+void hashPrint();
+
+// The command hash table itself
+struct HashEntry* hashTable[HASH_BUCKETS] = {NULL};
+
+// Number of entries kept in history, unless the HISTSIZE environment variable says otherwise
+#define HIST_DEFAULT_SIZE 50
+// Largest HISTSIZE accepted
+#define HIST_MAX_SIZE (1L << 24)
+// Marks an empty slot in histLookup
+#define HIST_NONE 0xFFFFFFFF
+// Largest the history arena gets, since offsets into it are 32 bits (and HIST_NONE isn't one)
+#define HIST_ARENA_MAX ((size_t)1 << 31)
+
+// Header in front of each distinct command in the history arena
+// The command's bytes and a null terminator follow it, padded to a multiple of 4
+struct HistRecord {
+	uint32_t len;  // Length of the command, not counting the null terminator
+	uint32_t refs;  // Number of history entries that are this command (0 once all are evicted)
+	uint32_t hash;  // hashString() of the command (used as a forwarding offset while compacting)
+};
+
+// Set the history size from HISTSIZE
+void histInit();
+
+// Add cmd as the newest history entry, evicting the oldest if history is full
+// (or if the arena is as big as it can get), or leave it out if it can't fit even then
+void histAdd(char* cmd);
+
+// Drop the oldest history entry
+void histEvict();
+
+// Return the i-th oldest history entry (0 is the oldest)
+char* histGet(long i);
+
+// Print the newest numEntries history entries, oldest first
+void histPrint(long numEntries);
+
+// Return the arena offset of cmd's record, appending one if it's new, and count one more use of it
+// Return HIST_NONE if the arena is already HIST_ARENA_MAX and compacting wouldn't make room
+uint32_t histIntern(char* cmd);
+
+// Count one less use of the record at off
+void histRelease(uint32_t off);
+
+// Move the records still in use to the front of the arena, dropping the rest
+void histCompact();
+
+// Rebuild histLookup with newSize slots from the records in the arena
+void histRehash(size_t newSize);
+
+// Marks the start of every record in the history file
+#define HIST_FILE_MAGIC 0x6873646A  // "djsh" read as a little-endian word
+
+// Header in front of each command in the history file, followed by the command's bytes
+// A record cut short by a crash fails its checksum, and loading (which works back from the end)
+// skips back past it to the one before
+struct HistFileRecord {
+	uint32_t magic;  // Always HIST_FILE_MAGIC
+	uint32_t len;  // Length of the command
+	uint32_t crc;  // crc32 of len and the command's bytes
+};
+
+// Open and map the history file named by HISTFILE (default ~/.djsh_history)
+// Nothing is read from it until histFileLoad()
+void histFileInit();
+
+// Put the history file's entries in front of this session's, the first time history is read
+void histFileLoad();
+
+// Queue cmd to be appended to the history file by the background writer
+void histFileAppend(char* cmd);
+
+// Find the last intact record in map that ends by *end, and move *end back to its start
+// Return 1 and set *cmd and *cmdLen if one was found, 0 at the start of the map
+int histFilePrev(char* map, size_t* end, char** cmd, uint32_t* cmdLen);
+
+// Bring history up to date (file and shared log) before it's read
+void histRefresh();
+
+// Body of the background writer thread, which appends queued records to the history file
+void* histFileWriter(void* unused);
+
+// Wait for the background writer to write out everything queued (run at exit)
+void histFileFlush();
+
+// Return crc updated with the len bytes at buf (CRC-32, as used by zlib)
+uint32_t crc32Update(uint32_t crc, const void* buf, size_t len);
+
+// History file state
+char* histFileName = NULL;  // NULL if history isn't being saved
+char* histFileMap = NULL;  // The file as it was at startup, until histFileLoad()
+size_t histFileMapSize = 0;
+int histFileLoaded = 0;
+// Records waiting for the writer, handed over under histFileLock
+pthread_mutex_t histFileLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t histFileCond = PTHREAD_COND_INITIALIZER;
+char* histFilePending = NULL;
+size_t histFilePendingUsed = 0;
+size_t histFilePendingSize = 0;
+int histFileStopping = 0;  // Set at exit to tell the writer to finish up
+int histFileWriterRunning = 0;
+pthread_t histFileWriterThread;
+
+// Bytes of commands the shared history log holds before it wraps around
+#define SHARED_HIST_SIZE (1 << 24)
+// Every record in the shared log starts on a multiple of this
+#define SHARED_HIST_ALIGN 16
+// Length of a record that only fills the space up to the end of the log
+#define SHARED_HIST_PAD 0xFFFFFFFF
+
+// Start of the shared history log, followed by SHARED_HIST_SIZE bytes of records
+// A fresh (all zero) segment is a valid empty log
+struct SharedHistHeader {
+	_Atomic uint64_t tail;  // Bytes ever reserved, the next record goes at tail % SHARED_HIST_SIZE
+	_Atomic uint64_t lapStart;  // Position of the first whole record since the log last wrapped
+	char pad[48];  // Keeps the records off the header's cache line
+};
+
+// Header in front of each command in the shared log, followed by the command's bytes
+// Positions are offsets into the log counted from its creation, so they never repeat
+struct SharedHistRecord {
+	_Atomic uint64_t pos;  // Position the record was reserved at plus 1, stored once it's complete
+	uint32_t size;  // Bytes reserved for it, including this header and padding
+	uint32_t len;  // Length of the command, or SHARED_HIST_PAD
+};
+
+// Map the shared history log named by DJSH_SHARED_HISTORY, if it's set
+void sharedHistInit();
+
+// Publish cmd to the shared log, so every session (this one included) picks it up on sync
+void sharedHistAppend(char* cmd);
+
+// Add every entry published to the shared log since the last sync to this session's history
+void sharedHistSync();
+
+// Shared history state
+struct SharedHistHeader* sharedHist = NULL;  // NULL unless sharing history
+char* sharedHistData = NULL;
+uint64_t sharedHistCursor = 0;  // Position of the next record this session hasn't read
+uint64_t sharedHistStuckAt = 0;  // Position of a record that still wasn't complete at the last sync
+int sharedHistStuckCount = 0;  // Syncs in a row that found it incomplete
+
+// History is a ring of offsets into one arena of distinct commands, so repeating a command
+// only costs its ring slot. histRing[(histStart + i) % histRingSize] is the i-th oldest entry
+long histSize = HIST_DEFAULT_SIZE;  // Most entries kept, the ring never grows past this
+uint32_t* histRing = NULL;
+long histRingSize = 0;  // Slots allocated so far, grows with use up to histSize
+long histStart = 0;  // Ring slot of the oldest entry
+long numHistory = 0;  // Number of entries in history (stops incrementing at histSize)
+char* histArena = NULL;
+size_t histArenaSize = 0;  // Bytes allocated for the arena
+size_t histArenaUsed = 0;  // Bytes used, including records no entry refers to anymore
+size_t histArenaDead = 0;  // Bytes of records no entry refers to, reclaimed by histCompact()
+// Open-addressed table of arena offsets, for finding a command's record by its text
+uint32_t* histLookup = NULL;
+size_t histLookupSize = 0;  // Always a power of 2
+size_t histNumRecords = 0;  // Records in the arena, whether or not they're in use
+long histSeqBase = 0;  // Sequence number of the oldest entry, counting up by one per eviction
+long histCurrentSeq = -1;  // Sequence number of the entry for the line being run, -1 if it has none
+
+// Posting list of the history entries that contain one trigram (3 consecutive bytes)
+struct HistPosting {
+	uint32_t trigram;  // The 3 bytes, packed into the low 24 bits
+	uint32_t* seqs;  // Entries containing it (sequence number - histIndexBase), oldest first
+	uint32_t count;
+	uint32_t cap;  // 0 marks an empty slot in histIndex
+};
+
+// Print the history entries matching pattern, oldest first, or only the newest if newestOnly
+// pattern matches anywhere in an entry, or only at the start if it begins with ^
+void histSearch(char* pattern, int newestOnly);
+
+// Add the trigrams of cmd, history entry number seq, to the search index
+void histIndexAdd(long seq, char* cmd);
+
+// Return the posting list for trigram, adding an empty one if create is 1 (or NULL if not)
+struct HistPosting* histIndexFind(uint32_t trigram, int create);
+
+// Throw away the search index so the next search rebuilds it
+void histIndexReset();
+
+// Trigram index over history, built by the first search and kept up to date after that
+// Open-addressed on the trigram, always a power of 2 in size and at most half full
+struct HistPosting* histIndex = NULL;
+size_t histIndexSize = 0;
+size_t histIndexUsed = 0;
+int histIndexBuilt = 0;
+long histIndexBase = 0;  // Sequence number the posting lists count from
+long histIndexEvictions = 0;  // Entries evicted since the index was built, still in its lists
+
+// How many leading bytes of each history entry go into the prefix trie
+#define HIST_TRIE_DEPTH 16
+
+// Node in the prefix trie over history, one per distinct leading byte sequence
+// Nodes live in histTrie and point to each other by index, with 0 (the root) meaning none
+struct HistTrieNode {
+	uint32_t child;  // First node one byte deeper
+	uint32_t sibling;  // Next node with the same parent
+	uint32_t latest;  // Newest entry starting with this node's bytes (sequence number - histTrieBase)
+	uint32_t tails;  // At the deepest level, the first of the commands that go on past it (0 for none)
+	unsigned char c;  // The byte this node adds
+};
+
+// A distinct command longer than HIST_TRIE_DEPTH, listed under the deepest node it reaches
+// so a longer prefix only has to be checked against these rather than all of history
+// They live in histTrieTails, with 0 meaning none
+struct HistTrieTail {
+	uint32_t latest;  // Newest entry that's this command (sequence number - histTrieBase)
+	uint32_t next;  // Next command under the same node
 };
 
+// Replace history references (!!, !n, !-n, !prefix) in line with the entries they name
+// Return 1 and set *expanded to a new malloc'd line if anything was replaced,
+// 0 if there was nothing to replace, or -1 if a reference doesn't name any entry
+int histExpand(char* line, char** expanded);
+
+// Return the position in history (0 is the oldest) of the newest entry starting with
+// the len bytes at prefix, or -1 if there isn't one
+long histFindPrefix(char* prefix, size_t len);
+
+// Add cmd, history entry number seq, to the prefix trie
+void histTrieAdd(long seq, char* cmd);
+
+// Record that the newest entry of cmd, longer than the trie is deep, is now seq, under node
+void histTrieAddTail(uint32_t node, long seq, char* cmd);
+
+// Throw away the prefix trie so the next !prefix rebuilds it
+void histTrieReset();
+
+// Prefix trie over history, built by the first !prefix and kept up to date after that
+struct HistTrieNode* histTrie = NULL;
+uint32_t histTrieUsed = 0;
+uint32_t histTrieSize = 0;
+int histTrieBuilt = 0;
+long histTrieBase = 0;  // Sequence number the nodes' latest entries count from
+long histTrieEvictions = 0;  // Entries evicted since the trie was built
+struct HistTrieTail* histTrieTails = NULL;
+uint32_t histTrieTailsUsed = 0;
+uint32_t histTrieTailsSize = 0;
+
 int main(int argc, char *argv[]) {
 
 	// Vars for reading input
@@ -48,282 +916,146 @@ int main(int argc, char *argv[]) {
 	const char default_msg[] = "**By default, execlp() will be used**\n";
 	const char execlp_msg[] = "**Based on your choice, execlp() will be used**\n";
 	const char execvp_msg[] = "**Based on your choice, execvp() will be used**\n";
-	char execType = 'l';  // 'l' for execlp, 'v' for execvp
+	const char spawn_msg[] = "**Based on your choice, posix_spawn() will be used**\n";
 	// djsh input
 	const char prompt[] = "djsh> ";
 	char* line = NULL;
+	char* expanded = NULL;  // line after history expansion
 	size_t len = 0;
 	ssize_t nread;
 
 	// Vars for parsing input
-	char* nextToken = NULL;
-	const char* whiteSpace = " \t\n\r";
-	// pointer to the string of the path/command + each argument + NULL terminator
-	char* args[MAX_ARGS+2] = {NULL}; 
-	char* command;  // the command WITHOUT its path
-
-	// Output redirection
-	int redirect = 0;  // Changes to 1 for redirect
-	char* filename = NULL;
-	FILE* file = NULL;
-	int output_fd = 1;  // 1 is stdout's default fd
-	int temp_fd;
+	// the line split up, its tokens being slices of the getline buffer
+	struct ParsedLine parsed = {0};
 
 	// History management
-	struct HistEntry* head = NULL;  // Oldest entry
-	struct HistEntry* tail = NULL;  // Newest entry
-	struct HistEntry* temp = NULL;
-	char* tempCmd = NULL;
-	int numHistory = 0;  // Number of entries in history (stops incrementing at 50)
-	int numEntriesToPrint;
+	char* tempCmd;
 
-	// Path
-	char* path = NULL;
-	char* cmdPath = NULL;
+	// Startup options
+	int batchJobs = 0;  // How many lines to run at once in batch mode, 0 for no batch mode
+	int lineMode = 0;  // Changes to 1 for batch output to be written line by line
+	char* scriptPath = NULL;  // Script to run instead of reading commands from stdin
+	const char* modeMsg = default_msg;  // Says which exec mode was picked
 
-	if (argc < 2) {
-		write(STDOUT_FILENO, default_msg, strlen(default_msg));
-	} else {
-		if (strcmp(argv[1], "-execlp") == 0) {
-			write(STDOUT_FILENO, execlp_msg, strlen(execlp_msg));
-		} else if (strcmp(argv[1], "-execvp") == 0) {
+	for (int i=1; i < argc; i++) {
+		if (strcmp(argv[i], "-execlp") == 0) {
+			execType = 'l';
+			modeMsg = execlp_msg;
+		} else if (strcmp(argv[i], "-execvp") == 0) {
 			execType = 'v';
-			write(STDOUT_FILENO, execvp_msg, strlen(execvp_msg));
+			modeMsg = execvp_msg;
+		} else if (strcmp(argv[i], "-spawn") == 0) {
+			execType = 's';
+			modeMsg = spawn_msg;
+		} else if (argv[i][0] != '-') {
+			// The script, anything after it being its own business
+			scriptPath = argv[i];
+			break;
+		} else if (strcmp(argv[i], "-j") == 0) {
+			// The count is always taken, so a bad one can't be mistaken for a script
+			char* end = NULL;
+			long count = i+1 < argc ? strtol(argv[++i], &end, 10) : 0;
+			if (end == NULL || *end != '\0' || count <= 0 || count > INT_MAX)
+				djsh_error();
+			else
+				batchJobs = (int)count;
+		} else if (strcmp(argv[i], "-l") == 0) {
+			lineMode = 1;
 		} else {
 			djsh_error();
-			write(STDOUT_FILENO, default_msg, strlen(default_msg));
 		}
 	}
+	// A script's output is its own, so it isn't told which exec mode is being used
+	if (scriptPath == NULL)
+		write(STDOUT_FILENO, modeMsg, strlen(modeMsg));
+
+	histInit();
+	histFileInit();
+	sharedHistInit();
+	jobsInit();
+
+	if (scriptPath != NULL)
+		exit(runScript(scriptPath, batchJobs, lineMode) != 0 ? 1 : 0);
+	// Input that isn't being typed can be read ahead and run several lines at a time
+	if (batchJobs > 0 && !isatty(STDIN_FILENO)) {
+		runBatch(batchJobs, lineMode);
+		exit(0);
+	}
 
 	// Main loop
 	while(1) {
-		write(STDOUT_FILENO, prompt, strlen(prompt));
+		waitForInput(prompt);
 		nread = getline(&line, &len, stdin);
 
-		// If input failed then just skip it all
-		if (nread == -1)
+		// If input failed then just skip it all, or leave like exit at the end of input
+		if (nread == -1) {
+			if (feof(stdin))
+				exit(0);
+			clearerr(stdin);
 			continue;
-		
-		/// HISTORY
-		// Add command to history
-		temp = (struct HistEntry*)malloc(sizeof(struct HistEntry));
-		if (temp == NULL) {
-			//perror("Memory allocation failure\n");
-			djsh_error();
-			exit(1);
 		}
+		/// HISTORY
 		// First replace trailing carriage return with null terminator
 		if (line[nread-1] == '\n') {
 			line[nread-1] = '\0';
 			if (nread >= 2 && line[nread-2] == '\r')
 				 line[nread-2] = '\0';
 		}
-		// Copy the command and store it
-		if (nread == 0 
-			|| nread == 1 & line[0] == '\0'
-			|| strcmp(line, "\r\n") == 0) {
-			// just store a space if blank input
-			tempCmd = (char*)malloc(sizeof(char) * 2);
-			tempCmd = " \0";
-		} else {
-			if (line[nread-1] == '\0')
-				tempCmd = (char*)malloc(sizeof(char) * (strlen(line)));
-			else
-				tempCmd = (char*)malloc(sizeof(char) * (strlen(line+1)));
-			strcpy(tempCmd, line);
-			if (tempCmd == NULL) {
-				//perror("Memory allocation failure\n");
+		// Swap in any history references before the line is stored or parsed
+		if (strchr(line, '!') != NULL) {
+			histRefresh();
+			switch (histExpand(line, &expanded)) {
+			case -1:
 				djsh_error();
-				exit(1);
+				continue;
+			case 1:
+				// Show what's actually being run, then make it the line
+				free(line);
+				line = expanded;
+				len = strlen(line) + 1;
+				write(STDOUT_FILENO, line, strlen(line));
+				write(STDOUT_FILENO, "\n", sizeof(char));
+				break;
 			}
 		}
-		temp->cmd = tempCmd;
-		// No head? set it (and the tail)
-		if (head == NULL) {
-			head = temp;
-			tail = temp;
+		// Add command to history, just storing a space if blank input
+		// When sharing, it reaches this session's history through the shared log like anyone else's
+		if (line[0] == '\0') {
+			tempCmd = " ";
 		} else {
-			// point tail to the new entry, and now remember it as the tail instead
-			tail->next = temp;
-			tail = temp;
+			tempCmd = line;
 		}
-		// If there are already <50 entries just increment, otherwise delete oldest
-		if (numHistory < 50) {
-			numHistory++;
+		if (sharedHist != NULL) {
+			sharedHistAppend(tempCmd);
+			sharedHistSync();
 		} else {
-			// More than 50 entries, so delete the oldest (head)
-			// Here we're repurposing temp to remember the old head
-			temp = head;
-			head = head->next;
-			if (temp->cmd != NULL)
-				free(temp->cmd);
-			free(temp);
+			histAdd(tempCmd);
 		}
+		histCurrentSeq = histSeqBase + numHistory - 1;
+		histFileAppend(tempCmd);
 
 		/// ARGUMENTS	
-		// Parse the arguments from the input
-		for (int i=0; i < MAX_ARGS+2; i++) {
-			// First free any previously held args if applicable
-			if (i < MAX_ARGS+1 && args[i] != NULL)
-				free(args[i]);
-			// copy each argument string into dynamic memory for easy access
-			if (i == 0)
-				nextToken = strtok(line, whiteSpace);
-			else
-				nextToken = strtok(NULL, whiteSpace);
-			if (nextToken != NULL) {
-				// first check if we're trying to redirect output
-				if (strcmp(nextToken, ">") == 0) {
-					// get dest filename
-					filename = strtok(NULL, whiteSpace);
-					// set up output file
-					output_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-					if (output_fd < 0) {
-						//perror("error opening file for output redirection");
-						djsh_error();
-					} else {
-						// first save stdout's fd
-						temp_fd = dup(STDOUT_FILENO); 
-						// redirect output from stdout to the file
-						if (dup2(output_fd, STDOUT_FILENO) == -1) {
-							//perror("dup2 failed");
-							djsh_error();
-						} else 
-							redirect = 1;
-					}
-					// Make sure ">" isn't saved as an argument
-					if (i < MAX_ARGS) {
-						args[i] = NULL;
-					} else {  // We're past the space for actual args, so break
-						break;
-					}
-				} else if (i < MAX_ARGS) {
-					// allocate memory to store the (going to be null-terminated) arg
-					args[i] = (char*)malloc((strlen(nextToken)+1) * sizeof(char));
-					strcpy(args[i], nextToken);
-				}
-			}
-			else {
-				// Set this arg to null
-				args[i] = NULL;
-
-				// If no first argument, not a valid input
-				if (i == 0) {
-					djsh_error();
-					break;
-				}
-			}
+		// Split the line in place, so the arguments point into the getline buffer
+		// instead of each being copied into its own malloc
+		// No command somewhere, not a valid input so skip this iteration
+		if (parseLine(line, &parsed) < 0) {
+			djsh_error();
+			continue;
 		}
-		// No first argument, skip this iteration
-		if (args[0] == NULL)
+		// Any here-document bodies come next in the input
+		if (prepareHereDocs(&parsed, stdin) < 0) {
+			djsh_error();
+			closeHereDocs(&parsed);
 			continue;
+		}
 
 		/// COMMANDS
-		// Handle built-in commands
-		if (strcmp(args[0], "exit") == 0) {
-			// If there are arguments then error, otherwise exit djsh
-			if (strtok(NULL, whiteSpace) != NULL) {
-				djsh_error();
-			} else {
-				exit(0);
-			}
-		} else if (strcmp(args[0], "cd") == 0) {
-			if (args[1] == NULL || args[2] != NULL) {
-				// Must take exactly one argument
-				djsh_error();
-			} else {
-				// Change directory, error if fails
-				if (chdir(args[1]) < 0) {
-					djsh_error();
-				}
-			}
-		} else if (strcmp(args[0], "path") == 0) {
-			if (args[1] == NULL) {
-				// No args provided, print path instead
-				if (path != NULL)
-					write(STDOUT_FILENO, path, strlen(path));
-					write(STDOUT_FILENO, "\n", sizeof(char));
-			} else {
-				// Write/overwrite path
-				// First delete old one (if it exists), then copy nextToken into new one
-				if (path != NULL)
-					free(path);
-				path = (char*)malloc(sizeof(char) * (strlen(args[1])+1));
-				if (path == NULL) {
-					//perror("path malloc");
-					djsh_error();
-					continue;  // skip to next iteration
-				}
-				strcpy(path, args[1]);
-			}
-		} else if (strcmp(args[0], "history") == 0) {
-			// will use temp to track current entry
-			temp = head;
-
-			// If arg n, set things up to print n-many entries
-			if (args[1] != NULL) {
-				// Just using this to avoid multiple atoi calls I suppose
-				numEntriesToPrint = atoi(args[1]);
-				if (numEntriesToPrint < 0 || numEntriesToPrint > 50) {
-					djsh_error();
-					continue;
-				} else {
-					// skip past all the unwanted entries
-					for (int i=0; i < (numHistory - numEntriesToPrint) && i < numHistory; i++) {
-						if (temp != NULL)
-							temp = temp->next;
-					}
-				}
-			}
-			// Print entries
-			while (temp != NULL) {
-				if (temp->cmd != NULL)
-					write(STDOUT_FILENO, temp->cmd, strlen(temp->cmd));
-				write(STDOUT_FILENO, "\n", sizeof(char));
-				temp = temp->next;
-			}
-		} else {  // Non-builtin commands
-			// Make child process
-			pid_t pid = fork();
-			if (pid < 0) {  // error
-				//fprintf(stderr, "Fork Failed");
-				djsh_error();
-				return 1;
-			}
-			else if (pid == 0) {  // child
-				cmdPath = checkPath(args[0], path);
-				if (cmdPath == 0) {  // no path found
-					djsh_error();
-				} else {
-					if (execType == 'l') {
-						command = getCommandFromPath(args[0]);
-						if (execlp(cmdPath, command, args[1], args[2], args[3], args[4], NULL) < 0) {
-							//perror("execlp error\n");
-							djsh_error();
-							exit(1);  // exit this child process
-						} 
-					} else if (execType == 'v') {
-						if (execvp(cmdPath, &args[0]) < 0) {
-							//perror("execvp error\n");
-							djsh_error();
-							exit(1);  // exit this child process
-						}
-					}
-				}
-			}
-			else { // should be parent
-				// wait for child process to terminate	
-				wait(NULL);
-			}
-		}
-		// If redirected, direct output back to stdout and close the file
-		if (redirect == 1) {
-			if (dup2(temp_fd, STDOUT_FILENO) == -1) {
-				//perror("error switching back to stdout from file");
-				djsh_error();
-			}
-			close(output_fd);
-		}
+		// Redirections are applied in the child, or just around a built-in run right here
+		if (parsed.numStages > 1 || parsed.background || !isBuiltin(parsed.stages[0].args[0]))
+			runPipeline(parsed.stages, parsed.numStages, parsed.background);
+		else
+			runLoneBuiltin(&parsed.stages[0]);
+		closeHereDocs(&parsed);
 	}
 	return 0;
 }
@@ -356,43 +1088,4104 @@ char* getCommandFromPath(char* cmdPath) {
 	return cmdPath;
 }
 
-void djsh_error() {
-	char error_message[] = "An error has occurred (from DJ)\n";
-	write(STDERR_FILENO, error_message, strlen(error_message));
-}
+int parseLine(char* line, struct ParsedLine* parsed) {
+	char** toks;
+	int numTokens = tokenizeLine(line, &parsed->tokens, &parsed->maxTokens);
+	int numStages = 0;
+	int numRedirects = 0;
+	int numArgs = 0;
+	int stageStart = 0;  // where the current stage's arguments start in tokens
+	int stageRedirects = 0;  // where the current stage's redirections start
+	struct Redirect* r;
 
-char* checkPath(char* cmd, char* path) {
-	// Check for command along path's directories
-	// Start by getting first token
-	char* nextToken = strtok(path, ":");
-	char* curPath;
-	while (nextToken != NULL) {
-		// Copy nextToken into its own char* (with extra space) for safer concatenation
-		curPath = (char*)malloc(sizeof(char) * (strlen(nextToken) + 1 + 1024));
-		if (curPath == NULL) {
-			//perror("curPath malloc");
-			djsh_error();
-			exit(1); // Exit the current process (probably a child)
+	toks = parsed->tokens;
+	parsed->numStages = 0;
+	// A trailing & puts the whole line in the background
+	parsed->background = 0;
+	if (numTokens > 0 && strcmp(toks[numTokens-1], "&") == 0) {
+		parsed->background = 1;
+		numTokens--;
+	}
+	// Then split the tokens into stages on "|", compacting each stage's arguments
+	// (minus any redirection) in place and ending them with a NULL
+	for (int i=0; i <= numTokens; i++) {
+		if (i == numTokens || strcmp(toks[i], "|") == 0) {
+			// Every stage needs a command
+			if (numArgs == stageStart)
+				return -1;
+			if (numStages == parsed->maxStages) {
+				parsed->maxStages = parsed->maxStages < 4 ? 4 : parsed->maxStages * 2;
+				parsed->stages = (struct Stage*)realloc(parsed->stages,
+					sizeof(struct Stage) * parsed->maxStages);
+				if (parsed->stages == NULL) {
+					//perror("stages realloc");
+					djsh_error();
+					exit(1);
+				}
+			}
+			parsed->stages[numStages].args = &toks[stageStart];
+			parsed->stages[numStages].numRedirects = numRedirects - stageRedirects;
+			numStages++;
+			// The NULL lands in the "|"'s slot or before it
+			toks[numArgs++] = NULL;
+			stageStart = numArgs;
+			stageRedirects = numRedirects;
+			continue;
 		}
-		strcpy(curPath, nextToken);
-
-		// add / to end if not already
-		if (curPath[strlen(curPath)-1] != '/') {
-			strcat(curPath, "/");
+		if (strcmp(toks[i], "&") == 0) {
+			// Only allowed at the end of the line
+			return -1;
 		}
-		
-		// Concatenate cmd onto nextToken
-		strcat(curPath, cmd);
-		// Check if this forms a viable cmd path
-		if (access(curPath, X_OK) == 0) {
+		if (numRedirects == parsed->maxRedirects) {
+			parsed->maxRedirects = parsed->maxRedirects < 4 ? 4 : parsed->maxRedirects * 2;
+			parsed->redirects = (struct Redirect*)realloc(parsed->redirects,
+				sizeof(struct Redirect) * parsed->maxRedirects);
+			if (parsed->redirects == NULL) {
+				//perror("redirects realloc");
+				djsh_error();
+				exit(1);
+			}
+		}
+		r = &parsed->redirects[numRedirects];
+		switch (parseRedirect(toks[i], r)) {
+		case 0:
+			toks[numArgs++] = toks[i];
+			break;
+		case 1:
+			// get the filename, the redirection itself happens once the command is started
+			i++;
+			if (i >= numTokens || strcmp(toks[i], "|") == 0) {
+				// No filename to redirect to
+				return -1;
+			}
+			if (r->hereType)
+				r->here = toks[i];
+			else
+				r->filename = toks[i];
+			numRedirects++;
+			break;
+		case 2:
+			numRedirects++;
+			break;
+		default:
+			// Looks like a redirection but isn't one (eg >&file)
+			return -1;
+		}
+	}
+	// The redirections won't move any more, so each stage can point at its own
+	numRedirects = 0;
+	for (int i=0; i < numStages; i++) {
+		parsed->stages[i].redirects = &parsed->redirects[numRedirects];
+		numRedirects += parsed->stages[i].numRedirects;
+	}
+	parsed->numStages = numStages;
+	return numStages;
+}
+
+int parseRedirect(char* token, struct Redirect* r) {
+	char* c = token;
+	char* end;
+
+	r->op = token;
+	r->filename = NULL;
+	r->dupFd = -1;
+	r->savedFd = -1;
+	r->hereType = 0;
+	r->here = NULL;
+	r->body = NULL;
+	// An fd number can come first, otherwise it's stdin for < and stdout for >
+	r->fd = -1;
+	if (*c >= '0' && *c <= '9') {
+		r->fd = (int)strtol(c, &end, 10);
+		c = end;
+	}
+	if (*c == '<') {
+		r->flags = O_RDONLY;
+		if (r->fd < 0)
+			r->fd = STDIN_FILENO;
+		if (c[1] == '<') {
+			// << or <<<, with the word either stuck on the end or in the next token
+			r->hereType = c[2] == '<' ? 's' : 'd';
+			c += r->hereType == 's' ? 3 : 2;
+			if (*c == '\0')
+				return 1;
+			r->here = c;
+			return 2;
+		}
+	} else if (*c == '>') {
+		r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (r->fd < 0)
+			r->fd = STDOUT_FILENO;
+		if (c[1] == '>') {
+			r->flags = O_WRONLY | O_CREAT | O_APPEND;
+			c++;
+		}
+	} else {
+		return 0;
+	}
+	c++;
+	if (*c == '\0')
+		return 1;
+	// A filename stuck on the end (eg 2>/dev/null)
+	if (*c != '&') {
+		r->filename = c;
+		return 2;
+	}
+	// n>&m or n<&m
+	if (c[1] < '0' || c[1] > '9' || (r->flags & O_APPEND))
+		return -1;
+	r->dupFd = (int)strtol(c+1, &end, 10);
+	if (*end != '\0')
+		return -1;
+	return 2;
+}
+
+int applyRedirects(struct Redirect r[], int numRedirects, int save) {
+	int fileFd;
+
+	for (int i=0; i < numRedirects; i++) {
+		if (save) {
+			// Keep the original out of the way of low fds, and of anything exec'd meanwhile
+			r[i].savedFd = fcntl(r[i].fd, F_DUPFD_CLOEXEC, 10);
+			if (r[i].savedFd < 0 && errno != EBADF) {
+				restoreRedirects(r, i);
+				return -1;
+			}
+		}
+		if (r[i].filename != NULL) {
+			fileFd = open(r[i].filename, r[i].flags | O_CLOEXEC, 0666);
+			if (fileFd < 0)
+				goto fail;
+			if (fileFd != r[i].fd) {
+				if (dup2(fileFd, r[i].fd) < 0) {
+					close(fileFd);
+					goto fail;
+				}
+				close(fileFd);
+			} else {
+				// Opened right onto the fd, which shouldn't be close-on-exec after all
+				fcntl(fileFd, F_SETFD, 0);
+			}
+		} else if (r[i].dupFd != r[i].fd && dup2(r[i].dupFd, r[i].fd) < 0) {
+			goto fail;
+		}
+		if (r[i].fd == STDIN_FILENO && save)
+			stdinRedirected = 1;
+		continue;
+fail:
+		if (save)
+			restoreRedirects(r, i+1);
+		return -1;
+	}
+	return 0;
+}
+
+int prepareHereDocs(struct ParsedLine* parsed, FILE* in) {
+	struct Redirect* r;
+	int numRedirects = 0;
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t nread;
+	int failed = 0;
+
+	for (int i=0; i < parsed->numStages; i++)
+		numRedirects += parsed->stages[i].numRedirects;
+	for (int i=0; i < numRedirects; i++) {
+		r = &parsed->redirects[i];
+		if (!r->hereType)
+			continue;
+		// An anonymous in-memory file, so nothing is written to disk and no helper process
+		// has to feed a pipe
+		r->dupFd = memfd_create("djsh-here", MFD_CLOEXEC);
+		if (r->dupFd < 0)
+			failed = 1;
+		if (r->hereType == 's') {
+			if (r->dupFd >= 0) {
+				writeAll(r->dupFd, r->here, strlen(r->here));
+				writeAll(r->dupFd, "\n", 1);
+			}
+		} else if (r->body != NULL) {
+			if (r->dupFd >= 0)
+				writeAll(r->dupFd, r->body, strlen(r->body));
+		} else {
+			// The body still has to be read even if there's nowhere to put it
+			while (1) {
+				if (isatty(fileno(in)))
+					write(STDOUT_FILENO, "> ", 2);
+				if ((nread = getline(&line, &len, in)) == -1)
+					break;
+				if (nread > 0 && line[nread-1] == '\n')
+					line[--nread] = '\0';
+				if (nread > 0 && line[nread-1] == '\r')
+					line[--nread] = '\0';
+				if (strcmp(line, r->here) == 0)
+					break;
+				if (r->dupFd >= 0) {
+					line[nread] = '\n';
+					writeAll(r->dupFd, line, nread + 1);
+				}
+			}
+			if (feof(in))
+				clearerr(in);
+		}
+		// The command reads it from the start
+		if (r->dupFd >= 0)
+			lseek(r->dupFd, 0, SEEK_SET);
+	}
+	free(line);
+	return failed ? -1 : 0;
+}
+
+char* redirectWord(struct Redirect* r) {
+	char* word = r->filename != NULL ? r->filename : r->here;
+	// A filename or here word stuck on the end of the operator is already part of it
+	if (word != NULL && (word < r->op || word > r->op + strlen(r->op)))
+		return word;
+	return NULL;
+}
+
+void closeHereDocs(struct ParsedLine* parsed) {
+	int numRedirects = 0;
+	for (int i=0; i < parsed->numStages; i++)
+		numRedirects += parsed->stages[i].numRedirects;
+	for (int i=0; i < numRedirects; i++) {
+		if (parsed->redirects[i].hereType && parsed->redirects[i].dupFd >= 0) {
+			close(parsed->redirects[i].dupFd);
+			parsed->redirects[i].dupFd = -1;
+		}
+	}
+}
+
+void restoreRedirects(struct Redirect r[], int numRedirects) {
+	// Last applied is first undone, so an fd redirected twice ends up as it started
+	for (int i=numRedirects-1; i >= 0; i--) {
+		if (r[i].savedFd >= 0) {
+			dup2(r[i].savedFd, r[i].fd);
+			close(r[i].savedFd);
+		} else {
+			close(r[i].fd);
+		}
+		r[i].savedFd = -1;
+	}
+	stdinRedirected = 0;
+}
+
+int runBuiltin(char* args[]) {
+	const struct Builtin* builtin = findBuiltin(args[0]);
+	int numArgs = 0;
+
+	if (builtin == NULL)
+		return 1;
+	while (args[numArgs+1] != NULL)
+		numArgs++;
+	if (numArgs < builtin->minArgs || (builtin->maxArgs >= 0 && numArgs > builtin->maxArgs)) {
+		djsh_error();
+		return 1;
+	}
+	return builtin->handler(args);
+}
+
+int builtinExit(char* args[]) {
+	if (runningScript) {
+		scriptExited = 1;
+		return 0;
+	}
+	exit(0);
+}
+
+int builtinCd(char* args[]) {
+	// Change directory, error if fails
+	if (chdir(args[1]) < 0) {
+		djsh_error();
+		return 1;
+	}
+	if (closeRelativePathDirs()) {
+		// Commands found through a relative directory may now be elsewhere
+		invalidatePathIndex();
+		hashClear(1);
+	}
+	return 0;
+}
+
+int builtinPath(char* args[]) {
+	if (args[1] == NULL) {
+		// No args provided, print path instead
+		if (path != NULL)
+			write(STDOUT_FILENO, path, strlen(path));
+		write(STDOUT_FILENO, "\n", sizeof(char));
+		return 0;
+	}
+	// Write/overwrite path
+	// First delete old one (if it exists), then copy the argument into new one
+	if (path != NULL)
+		free(path);
+	path = (char*)malloc(sizeof(char) * (strlen(args[1])+1));
+	if (path == NULL) {
+		//perror("path malloc");
+		djsh_error();
+		return 1;
+	}
+	strcpy(path, args[1]);
+	setPathDirs(path);
+	invalidatePathIndex();
+	// Remembered locations may no longer be right for the new path
+	hashClear(1);
+	return 0;
+}
+
+int builtinHistory(char* args[]) {
+	int numEntriesToPrint;
+
+	histRefresh();
+	// Print every entry unless given a number
+	numEntriesToPrint = numHistory;
+	if (args[1] != NULL && (strcmp(args[1], "-s") == 0 || strcmp(args[1], "-r") == 0)) {
+		// Must take exactly one pattern
+		if (args[2] == NULL) {
+			djsh_error();
+			return 1;
+		}
+		histSearch(args[2], args[1][1] == 'r');
+		return 0;
+	} else if (args[1] != NULL) {
+		// Just using this to avoid multiple atoi calls I suppose
+		numEntriesToPrint = atoi(args[1]);
+		if (numEntriesToPrint < 0 || numEntriesToPrint > histSize) {
+			djsh_error();
+			return 1;
+		}
+	}
+	histPrint(numEntriesToPrint);
+	return 0;
+}
+
+int builtinJobs(char* args[]) {
+	jobsPoll(0);
+	for (int i=0; i < maxJobs; i++) {
+		if (jobs[i].line != NULL && jobs[i].numRunning > 0)
+			printf("[%d] Running\t%s\n", i+1, jobs[i].line);
+	}
+	fflush(stdout);
+	// Finished ones are listed (and forgotten) here rather than at the next prompt
+	jobsNotify(0);
+	return 0;
+}
+
+int builtinWait(char* args[]) {
+	int status = 0;
+	if (args[1] == NULL) {
+		jobsWait(-1);
+		return 0;
+	}
+	for (int i=1; args[i] != NULL; i++) {
+		int slot = jobSlot(args[i]);
+		if (slot < 0) {
+			djsh_error();
+			status = 1;
+		} else {
+			jobsWait(slot);
+		}
+	}
+	return status;
+}
+
+int builtinFg(char* args[]) {
+	int slot = jobSlot(args[1]);
+	if (slot < 0) {
+		djsh_error();
+		return 1;
+	}
+	// There's no terminal control to hand over, so this just waits on the job like bash would
+	write(STDOUT_FILENO, jobs[slot].line, strlen(jobs[slot].line));
+	write(STDOUT_FILENO, "\n", sizeof(char));
+	jobsWait(slot);
+	return 0;
+}
+
+int builtinParallel(char* args[]) {
+	return runParallel(args);
+}
+
+int builtinHash(char* args[]) {
+	int status = 0;
+	if (args[1] == NULL) {
+		hashPrint();
+	} else if (strcmp(args[1], "-r") == 0) {
+		if (args[2] != NULL) {
+			djsh_error();
+			return 1;
+		}
+		hashClear(0);
+	} else if (strcmp(args[1], "-p") == 0) {
+		// Must take exactly a path and a name
+		if (args[2] == NULL || args[3] == NULL || args[4] != NULL) {
+			djsh_error();
+			return 1;
+		}
+		hashInsert(args[3], args[2], 1);
+	} else {
+		// Look up each given command so it's remembered for later
+		for (int i=1; args[i] != NULL; i++) {
+			if (hashLookup(args[i]) == NULL) {
+				djsh_error();
+				status = 1;
+			}
+		}
+	}
+	return status;
+}
+
+int builtinEcho(char* args[]) {
+	int newline = 1;
+	int escapes = 0;
+	int i = 1;
+
+	// Like bash, only arguments made up entirely of -n, -e and -E are options
+	for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		if (strspn(&args[i][1], "neE") != strlen(&args[i][1]))
+			break;
+		for (char* c = &args[i][1]; *c != '\0'; c++) {
+			if (*c == 'n')
+				newline = 0;
+			else
+				escapes = (*c == 'e');
+		}
+	}
+	for (int first = i; args[i] != NULL; i++) {
+		if (i > first)
+			putchar(' ');
+		if (!escapes)
+			fputs(args[i], stdout);
+		else if (putEscaped(args[i]))
+			return 0;
+	}
+	if (newline)
+		putchar('\n');
+	return 0;
+}
+
+int builtinPrintf(char* args[]) {
+	char** next = &args[2];
+	int status = 0;
+
+	// The format is reused for as long as there are arguments left for it to take
+	for (;;) {
+		char** before = next;
+		if (printfFormat(args[1], &next, &status) || *next == NULL || next == before)
+			break;
+	}
+	return status;
+}
+
+int builtinTest(char* args[]) {
+	struct TestState t;
+	int numArgs = 0;
+	int result;
+
+	while (args[numArgs+1] != NULL)
+		numArgs++;
+	// [ is the same thing, just with a ] on the end
+	if (strcmp(args[0], "[") == 0) {
+		if (strcmp(args[numArgs], "]") != 0) {
+			djsh_error();
+			return 2;
+		}
+		numArgs--;
+	}
+	t.error = 0;
+	result = testArgs(&t, &args[1], numArgs);
+	if (t.error) {
+		djsh_error();
+		return 2;
+	}
+	return !result;
+}
+
+int builtinTrue(char* args[]) {
+	return 0;
+}
+
+int builtinFalse(char* args[]) {
+	return 1;
+}
+
+int builtinPwd(char* args[]) {
+	char cwd[PATH_MAX];
+
+	// There are no symlinks remembered from cd, so -L and -P are one and the same
+	if (args[1] != NULL && strcmp(args[1], "-L") != 0 && strcmp(args[1], "-P") != 0) {
+		djsh_error();
+		return 1;
+	}
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		//perror("getcwd");
+		djsh_error();
+		return 1;
+	}
+	puts(cwd);
+	return 0;
+}
+
+int putEscape(char** s, int echoStyle) {
+	char* c = *s;
+	int value = 0;
+	int digits = 0;
+
+	switch (*c) {
+		case 'a': putchar('\a'); break;
+		case 'b': putchar('\b'); break;
+		case 'c': return 1;
+		case 'e': putchar('\033'); break;
+		case 'f': putchar('\f'); break;
+		case 'n': putchar('\n'); break;
+		case 'r': putchar('\r'); break;
+		case 't': putchar('\t'); break;
+		case 'v': putchar('\v'); break;
+		case '\\': putchar('\\'); break;
+		case 'x':
+			// Up to two hex digits
+			for (; digits < 2 && isxdigit((unsigned char)c[1]); digits++, c++)
+				value = value*16 + (isdigit((unsigned char)c[1]) ? c[1]-'0' : (tolower(c[1])-'a'+10));
+			if (digits == 0)
+				fputs("\\x", stdout);
+			else
+				putchar(value);
+			break;
+		case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+			// Up to three octal digits, after a 0 for echo
+			if (echoStyle && *c != '0') {
+				putchar('\\');
+				putchar(*c);
+				break;
+			}
+			if (echoStyle)
+				c++;
+			for (; digits < 3 && *c >= '0' && *c <= '7'; digits++, c++)
+				value = value*8 + (*c - '0');
+			putchar(value);
+			c--;
+			break;
+		case '\0':
+			// A lone backslash at the very end
+			putchar('\\');
+			*s = c;
+			return 0;
+		default:
+			putchar('\\');
+			putchar(*c);
+	}
+	*s = c + 1;
+	return 0;
+}
+
+int putEscaped(char* str) {
+	while (*str != '\0') {
+		if (*str != '\\') {
+			putchar(*str++);
+			continue;
+		}
+		str++;
+		if (putEscape(&str, 1))
+			return 1;
+	}
+	return 0;
+}
+
+int printfFormat(char* format, char*** args, int* status) {
+	char* c = format;
+
+	while (*c != '\0') {
+		char spec[64];
+		int len = 0;
+		int hasPrecision = 0;
+		char* arg;
+
+		if (*c == '\\') {
+			c++;
+			if (putEscape(&c, 0))
+				return 1;
+			continue;
+		}
+		if (*c != '%') {
+			putchar(*c++);
+			continue;
+		}
+		if (c[1] == '%') {
+			putchar('%');
+			c += 2;
+			continue;
+		}
+		// Build up a spec for the C printf, with any * widths written in as numbers
+		spec[len++] = *c++;
+		while (*c != '\0' && strchr("-+ #0", *c) != NULL && len < 8)
+			spec[len++] = *c++;
+		for (int part=0; part < 2; part++) {
+			if (part == 1) {
+				if (*c != '.')
+					break;
+				hasPrecision = 1;
+				spec[len++] = *c++;
+			}
+			if (*c == '*') {
+				arg = **args;
+				if (arg != NULL)
+					(*args)++;
+				len += snprintf(&spec[len], 16, "%d", (int)printfInt(arg, status));
+				c++;
+			} else {
+				for (int digits=0; isdigit((unsigned char)*c); digits++, c++) {
+					if (digits < 9)
+						spec[len++] = *c;
+				}
+			}
+		}
+		arg = **args;
+		if (arg != NULL && *c != '\0' && strchr("sbcdiouxXfFeEgGaA", *c) != NULL)
+			(*args)++;
+		switch (*c) {
+			case 's':
+			case 'c':
+				// %c is just %s of one character, so a missing argument writes nothing
+				// It can't have a precision of its own, as in coreutils
+				if (*c == 'c' && hasPrecision) {
+					djsh_error();
+					*status = 1;
+					return 1;
+				}
+				if (*c == 'c')
+					len += sprintf(&spec[len], ".1");
+				strcpy(&spec[len], "s");
+				printf(spec, arg != NULL ? arg : "");
+				break;
+			case 'b':
+				// The argument's escapes are expanded, with whatever padding applied to the result
+				// left to the C printf only when there's no escape to worry about
+				if (arg != NULL && strchr(arg, '\\') != NULL) {
+					if (putEscaped(arg))
+						return 1;
+				} else {
+					strcpy(&spec[len], "s");
+					printf(spec, arg != NULL ? arg : "");
+				}
+				break;
+			case 'd':
+			case 'i':
+				sprintf(&spec[len], "ll%c", *c);
+				printf(spec, printfInt(arg, status));
+				break;
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				sprintf(&spec[len], "ll%c", *c);
+				printf(spec, (unsigned long long)printfInt(arg, status));
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				sprintf(&spec[len], "L%c", *c);
+				printf(spec, printfFloat(arg, status));
+				break;
+			default:
+				// Not a conversion printf knows
+				djsh_error();
+				*status = 1;
+				return 1;
+		}
+		c++;
+	}
+	return 0;
+}
+
+long long printfInt(char* arg, int* status) {
+	char* end;
+	long long value;
+
+	if (arg == NULL || *arg == '\0')
+		return 0;
+	if (*arg == '\'' || *arg == '"')
+		return (unsigned char)arg[1];
+	errno = 0;
+	value = strtoll(arg, &end, 0);
+	if (*end != '\0' || errno != 0) {
+		djsh_error();
+		*status = 1;
+	}
+	return value;
+}
+
+long double printfFloat(char* arg, int* status) {
+	char* end;
+	long double value;
+
+	if (arg == NULL || *arg == '\0')
+		return 0;
+	if (*arg == '\'' || *arg == '"')
+		return (unsigned char)arg[1];
+	errno = 0;
+	value = strtold(arg, &end);
+	if (*end != '\0' || errno != 0) {
+		djsh_error();
+		*status = 1;
+	}
+	return value;
+}
+
+int testArgs(struct TestState* t, char** args, int numArgs) {
+	t->args = args;
+	t->pos = 0;
+	t->end = numArgs;
+	switch (numArgs) {
+		case 0:
+			return 0;
+		case 1:
+			return args[0][0] != '\0';
+		case 2:
+			if (strcmp(args[0], "!") == 0)
+				return !testArgs(t, &args[1], 1);
+			if (isTestUnary(args[0]))
+				return testUnary(t, args[0], args[1]);
+			t->error = 1;
+			return 0;
+		case 3:
+			if (isTestBinary(args[1]))
+				return testBinary(t, args[0], args[1], args[2]);
+			if (strcmp(args[0], "!") == 0)
+				return !testArgs(t, &args[1], 2);
+			if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+				return testArgs(t, &args[1], 1);
+			break;
+		case 4:
+			if (strcmp(args[0], "!") == 0)
+				return !testArgs(t, &args[1], 3);
+			if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0)
+				return testArgs(t, &args[1], 2);
+			break;
+	}
+	int result = testOr(t);
+	if (t->pos != t->end)
+		t->error = 1;
+	return result;
+}
+
+int testOr(struct TestState* t) {
+	int result = testAnd(t);
+	while (!t->error && t->pos < t->end && strcmp(t->args[t->pos], "-o") == 0) {
+		t->pos++;
+		result = testAnd(t) || result;
+	}
+	return result;
+}
+
+int testAnd(struct TestState* t) {
+	int result = testNot(t);
+	while (!t->error && t->pos < t->end && strcmp(t->args[t->pos], "-a") == 0) {
+		t->pos++;
+		result = testNot(t) && result;
+	}
+	return result;
+}
+
+int testNot(struct TestState* t) {
+	if (t->pos < t->end && strcmp(t->args[t->pos], "!") == 0) {
+		t->pos++;
+		return !testNot(t);
+	}
+	return testPrimary(t);
+}
+
+int testPrimary(struct TestState* t) {
+	char** a = &t->args[t->pos];
+	int left = t->end - t->pos;
+	int result;
+
+	if (left <= 0) {
+		t->error = 1;
+		return 0;
+	}
+	if (left >= 3 && isTestBinary(a[1])) {
+		t->pos += 3;
+		return testBinary(t, a[0], a[1], a[2]);
+	}
+	if (strcmp(a[0], "(") == 0) {
+		t->pos++;
+		result = testOr(t);
+		if (t->pos >= t->end || strcmp(t->args[t->pos], ")") != 0) {
+			t->error = 1;
+			return 0;
+		}
+		t->pos++;
+		return result;
+	}
+	if (left >= 2 && isTestUnary(a[0])) {
+		t->pos += 2;
+		return testUnary(t, a[0], a[1]);
+	}
+	t->pos++;
+	return a[0][0] != '\0';
+}
+
+int isTestUnary(char* op) {
+	return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefgGhkLnOprsStuwxz", op[1]) != NULL;
+}
+
+int isTestBinary(char* op) {
+	const char* ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+		"-nt", "-ot", "-ef", NULL};
+	for (int i=0; ops[i] != NULL; i++) {
+		if (strcmp(op, ops[i]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int testUnary(struct TestState* t, char* op, char* arg) {
+	struct stat st;
+
+	switch (op[1]) {
+		case 'n': return arg[0] != '\0';
+		case 'z': return arg[0] == '\0';
+		case 't': return isatty((int)testInt(t, arg));
+		case 'r': return access(arg, R_OK) == 0;
+		case 'w': return access(arg, W_OK) == 0;
+		case 'x': return access(arg, X_OK) == 0;
+	}
+	// The rest are all about what kind of file it is
+	if ((op[1] == 'h' || op[1] == 'L') ? lstat(arg, &st) < 0 : stat(arg, &st) < 0)
+		return 0;
+	switch (op[1]) {
+		case 'b': return S_ISBLK(st.st_mode);
+		case 'c': return S_ISCHR(st.st_mode);
+		case 'd': return S_ISDIR(st.st_mode);
+		case 'e': return 1;
+		case 'f': return S_ISREG(st.st_mode);
+		case 'g': return (st.st_mode & S_ISGID) != 0;
+		case 'G': return st.st_gid == getegid();
+		case 'h':
+		case 'L': return S_ISLNK(st.st_mode);
+		case 'k': return (st.st_mode & S_ISVTX) != 0;
+		case 'O': return st.st_uid == geteuid();
+		case 'p': return S_ISFIFO(st.st_mode);
+		case 's': return st.st_size > 0;
+		case 'S': return S_ISSOCK(st.st_mode);
+		case 'u': return (st.st_mode & S_ISUID) != 0;
+	}
+	return 0;
+}
+
+int testBinary(struct TestState* t, char* left, char* op, char* right) {
+	struct stat leftSt, rightSt;
+	int leftOk, rightOk;
+
+	if (op[0] != '-') {
+		int cmp = strcmp(left, right);
+		switch (op[0]) {
+			case '=': return cmp == 0;
+			case '!': return cmp != 0;
+			case '<': return cmp < 0;
+			default: return cmp > 0;
+		}
+	}
+	if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+		// Comparing files, where one that doesn't exist counts as older than any that does
+		leftOk = stat(left, &leftSt) == 0;
+		rightOk = stat(right, &rightSt) == 0;
+		if (op[1] == 'e')
+			return leftOk && rightOk && leftSt.st_dev == rightSt.st_dev && leftSt.st_ino == rightSt.st_ino;
+		if (!leftOk || !rightOk)
+			return op[1] == 'n' ? leftOk : rightOk;
+		if (leftSt.st_mtim.tv_sec != rightSt.st_mtim.tv_sec)
+			return op[1] == 'n' ? leftSt.st_mtim.tv_sec > rightSt.st_mtim.tv_sec : leftSt.st_mtim.tv_sec < rightSt.st_mtim.tv_sec;
+		return op[1] == 'n' ? leftSt.st_mtim.tv_nsec > rightSt.st_mtim.tv_nsec : leftSt.st_mtim.tv_nsec < rightSt.st_mtim.tv_nsec;
+	}
+	long long a = testInt(t, left);
+	long long b = testInt(t, right);
+	if (strcmp(op, "-eq") == 0) return a == b;
+	if (strcmp(op, "-ne") == 0) return a != b;
+	if (strcmp(op, "-lt") == 0) return a < b;
+	if (strcmp(op, "-le") == 0) return a <= b;
+	if (strcmp(op, "-gt") == 0) return a > b;
+	return a >= b;
+}
+
+long long testInt(struct TestState* t, char* arg) {
+	char* end;
+	long long value;
+
+	// Surrounding blanks are allowed, like coreutils
+	errno = 0;
+	value = strtoll(arg, &end, 10);
+	while (isWhiteSpace(*end))
+		end++;
+	if (end == arg || *end != '\0' || errno != 0)
+		t->error = 1;
+	return value;
+}
+
+int builtinCat(char* args[]) {
+	int status = 0;
+	int i = 1;
+
+	for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		// Output is never buffered here anyway, so -u is the only option that can be honoured
+		// without looking at every byte; anything else is left to the real cat
+		if (strcmp(args[i], "-u") != 0)
+			return runExternal(args);
+	}
+	if (args[i] == NULL) {
+		if (catFd(STDIN_FILENO, STDOUT_FILENO) < 0) {
+			djsh_error();
+			return 1;
+		}
+		return 0;
+	}
+	for (; args[i] != NULL; i++) {
+		int fd = STDIN_FILENO;
+		if (strcmp(args[i], "-") != 0 && (fd = open(args[i], O_RDONLY | O_CLOEXEC)) < 0) {
+			//perror("cat open");
+			djsh_error();
+			status = 1;
+			continue;
+		}
+		if (catFd(fd, STDOUT_FILENO) < 0) {
+			//perror("cat");
+			djsh_error();
+			status = 1;
+		}
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+	return status;
+}
+
+int catFd(int inFd, int outFd) {
+	struct stat inSt, outSt;
+	char buf[65536];
+	ssize_t n;
+
+	if (fstat(inFd, &inSt) < 0 || fstat(outFd, &outSt) < 0)
+		return -1;
+	if (S_ISREG(inSt.st_mode) && inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino
+		&& ((fcntl(outFd, F_GETFL) & O_APPEND) || lseek(outFd, 0, SEEK_CUR) < inSt.st_size)) {
+		// cat a >> a would chase its own output forever
+		errno = EINVAL;
+		return -1;
+	}
+	if (inFd == STDIN_FILENO && !stdinRedirected && __freading(stdin)) {
+		// The shell's own input may already be partly read into stdin's buffer, so that goes first
+		if (ftello(stdin) >= 0) {
+			// Seekable, so flushing puts the fd back where the shell had read up to
+			fflush(stdin);
+		} else {
+			// Otherwise take what's buffered (and whatever's ready) without waiting for more
+			int flags = fcntl(STDIN_FILENO, F_GETFL);
+			fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+			while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+				writeAll(outFd, buf, n);
+				if (n < (ssize_t)sizeof(buf))
+					break;
+			}
+			clearerr(stdin);
+			fcntl(STDIN_FILENO, F_SETFL, flags);
+		}
+	}
+
+	// Every method below goes through the fds' own offsets, so each picks up where the last left off
+	if (S_ISREG(inSt.st_mode) && S_ISREG(outSt.st_mode)) {
+		// File to file can be done by the filesystem itself, even shared rather than copied
+		while ((n = copy_file_range(inFd, NULL, outFd, NULL, 1 << 30, 0)) > 0);
+		if (n == 0)
+			return 0;
+		// (an output opened with O_APPEND gets EBADF)
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+			return -1;
+	}
+	if (S_ISREG(inSt.st_mode) || S_ISBLK(inSt.st_mode)) {
+		// sendfile reads from the page cache, so it only needs the input to be a file
+		while ((n = sendfile(outFd, inFd, NULL, 1 << 30)) > 0);
+		if (n == 0)
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+	}
+	if (S_ISFIFO(inSt.st_mode) || S_ISFIFO(outSt.st_mode)) {
+		// Either end being a pipe lets splice move its pages across
+		while ((n = splice(inFd, NULL, outFd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0);
+		if (n == 0)
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+	}
+	// Terminals, sockets and the like go through a buffer after all
+	while ((n = read(inFd, buf, sizeof(buf))) > 0) {
+		for (ssize_t done = 0, w; done < n; done += w) {
+			if ((w = write(outFd, buf + done, n - done)) < 0)
+				return -1;
+		}
+	}
+	return n < 0 ? -1 : 0;
+}
+
+int runExternal(char* args[]) {
+	// The fds are already where they should be, so there's nothing to set up in the child
+	struct Stage stage = {args, NULL, 0};
+	char* cmdPath = hashLookup(args[0]);
+	pid_t pid;
+	int status;
+
+	if (cmdPath == NULL || (pid = spawnCommand(cmdPath, args, -1, -1, -1, &stage)) < 0) {
+		djsh_error();
+		return 1;
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		return 1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int runLoneBuiltin(struct Stage* stage) {
+	int status;
+
+	/// REDIRECTION
+	// A lone built-in runs right here, so its fds are swapped around it and then put back
+	// Anything already buffered has to go out where it was meant to first
+	fflush(stdout);
+	if (applyRedirects(stage->redirects, stage->numRedirects, 1) < 0) {
+		//perror("error applying redirection");
+		djsh_error();
+		return 1;
+	}
+	status = runBuiltin(stage->args);
+	fflush(stdout);
+	restoreRedirects(stage->redirects, stage->numRedirects);
+	return status;
+}
+
+int runPipeline(struct Stage stages[], int numStages, int background) {
+	pid_t* pids = (pid_t*)malloc(sizeof(pid_t) * numStages);
+	int status = W_EXITCODE(127, 0);  // A last stage that couldn't be started counts as not found
+
+	if (pids == NULL) {
+		//perror("pids malloc");
+		djsh_error();
+		exit(1);
+	}
+	startPipeline(stages, numStages, -1, -1, pids);
+	if (background) {
+		jobAdd(stages, numStages, pids);
+		free(pids);
+		return 0;
+	}
+	// Every stage is running at once, so wait for each of them by pid
+	for (int i=0; i < numStages; i++) {
+		if (pids[i] > 0)
+			waitpid(pids[i], i == numStages-1 ? &status : NULL, 0);
+	}
+	free(pids);
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+void startPipeline(struct Stage stages[], int numStages, int outFd, int errFd, pid_t pids[]) {
+	int pipeFds[2];
+	int inFd = -1;  // read end of the pipe from the previous stage
+	int numLaunched;
+
+	for (numLaunched = 0; numLaunched < numStages; numLaunched++) {
+		pipeFds[0] = -1;
+		pipeFds[1] = numLaunched == numStages-1 ? outFd : -1;
+		// Close-on-exec, so no child ends up holding a pipe end it wasn't given,
+		// which would keep the reader from ever seeing end of file
+		if (numLaunched < numStages-1 && pipe2(pipeFds, O_CLOEXEC) < 0) {
+			djsh_error();
+			break;
+		}
+		pids[numLaunched] = launchStage(&stages[numLaunched], inFd, pipeFds[1], errFd);
+		// The children have their ends now
+		if (inFd >= 0)
+			close(inFd);
+		if (pipeFds[1] >= 0 && pipeFds[1] != outFd)
+			close(pipeFds[1]);
+		inFd = pipeFds[0];
+	}
+	if (inFd >= 0)
+		close(inFd);
+	// Stages that didn't get started are left as -1
+	for (int i=numLaunched; i < numStages; i++)
+		pids[i] = -1;
+}
+
+pid_t launchStage(struct Stage* stage, int inFd, int outFd, int errFd) {
+	char** args = stage->args;
+	char* cmdPath = NULL;
+	char* command = NULL;  // the command WITHOUT its path
+	int numArgs = 0;
+	pid_t pid;
+
+	if (!isBuiltin(args[0])) {
+		// Resolve the command here in the parent so the result is remembered,
+		// and so an unknown command never costs a fork
+		cmdPath = hashLookup(args[0]);
+		if (cmdPath == NULL) {  // no path found
+			djsh_error();
+			return -1;
+		}
+		if (argsTooLong(args)) {
+			// exec would only fail with E2BIG, so don't bother launching
+			djsh_error();
+			return -1;
+		}
+		if (execType == 's') {
+			// posix_spawn does the exec itself, so there's no child code to run here
+			pid = spawnCommand(cmdPath, args, inFd, outFd, errFd, stage);
+			if (pid < 0)
+				djsh_error();
+			return pid;
+		}
+		// Work out argv[0] before forking so the child only has to exec
+		command = getCommandFromPath(args[0]);
+		while (args[numArgs] != NULL)
+			numArgs++;
+	}
+
+	// Make child process
+	pid = fork();
+	if (pid < 0) {  // error
+		//fprintf(stderr, "Fork Failed");
+		djsh_error();
+	}
+	else if (pid == 0) {  // child
+		// On failure use _exit so the child never runs the parent's exit handlers
+		if (setupChildFds(inFd, outFd, errFd, stage) < 0) {
+			djsh_error();
+			_exit(1);
+		}
+		if (cmdPath == NULL) {
+			// A built-in in a pipeline runs in its own process like any other stage
+			// The history writer thread didn't come along with the fork, so don't wait for it
+			histFileWriterRunning = 0;
+			// Whatever the shell had buffered belongs to the shell, not to this stage's stdin and stdout
+			__fpurge(stdin);
+			__fpurge(stdout);
+			int status = runBuiltin(args);
+			fflush(stdout);
+			_exit(status);
+		}
+		if (execType == 'l' && numArgs <= EXECLP_ARGS+1) {
+			// args ends at its NULL, so nothing past it is read
+			if (execlp(cmdPath, command, numArgs > 1 ? args[1] : NULL, numArgs > 2 ? args[2] : NULL,
+					numArgs > 3 ? args[3] : NULL, numArgs > 4 ? args[4] : NULL, NULL) < 0) {
+				//perror("execlp error\n");
+				djsh_error();
+				_exit(1);  // exit this child process
+			} 
+		} else if (execType == 'l') {
+			// Too many arguments to spell out for execlp(), so hand over the array
+			// (cmdPath already has a slash, so execv finds the same file)
+			args[0] = command;
+			if (execv(cmdPath, args) < 0) {
+				//perror("execv error\n");
+				djsh_error();
+				_exit(1);  // exit this child process
+			}
+		} else if (execType == 'v') {
+			if (execvp(cmdPath, &args[0]) < 0) {
+				//perror("execvp error\n");
+				djsh_error();
+				_exit(1);  // exit this child process
+			}
+		}
+		_exit(1);  // unknown execType, never fall back into the shell loop
+	}
+	if (command != NULL && command != args[0])
+		free(command);
+	return pid;
+}
+
+void jobsInit() {
+	struct epoll_event ev;
+
+	jobEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (jobEpollFd < 0)
+		return;
+	// Only worth watching stdin for a terminal: a pipe or file could have lines already
+	// sitting in stdin's buffer that epoll knows nothing about
+	if (!isatty(STDIN_FILENO))
+		return;
+	promptEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (promptEpollFd < 0)
+		return;
+	ev.events = EPOLLIN;
+	ev.data.fd = STDIN_FILENO;
+	if (epoll_ctl(promptEpollFd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0)
+		goto fail;
+	ev.data.fd = jobEpollFd;
+	if (epoll_ctl(promptEpollFd, EPOLL_CTL_ADD, jobEpollFd, &ev) < 0)
+		goto fail;
+	return;
+fail:
+	close(promptEpollFd);
+	promptEpollFd = -1;
+}
+
+void jobAdd(struct Stage stages[], int numStages, pid_t pids[]) {
+	struct Job* job;
+	size_t lineLen = 0;
+	int slot;
+	char* c;
+	int numStarted = 0;
+	int last = numStages-1;
+
+	// Nothing to wait for if none of it could be started (its error has been reported already)
+	for (int i=0; i < numStages; i++) {
+		if (pids[i] > 0)
+			numStarted++;
+	}
+	if (numStarted == 0)
+		return;
+	// Take the first free slot, growing the table if there isn't one
+	for (slot = 0; slot < maxJobs && jobs[slot].line != NULL; slot++);
+	if (slot == maxJobs) {
+		int newMax = maxJobs < 8 ? 8 : maxJobs * 2;
+		struct Job* newJobs = (struct Job*)realloc(jobs, sizeof(struct Job) * newMax);
+		if (newJobs == NULL) {
+			//perror("jobs realloc");
+			djsh_error();
+			exit(1);
+		}
+		memset(&newJobs[maxJobs], 0, sizeof(struct Job) * (newMax - maxJobs));
+		jobs = newJobs;
+		maxJobs = newMax;
+	}
+	job = &jobs[slot];
+
+	// Rebuild the line from the arguments, since the original was split up in place
+	for (int i=0; i < numStages; i++) {
+		for (int j=0; stages[i].args[j] != NULL; j++)
+			lineLen += strlen(stages[i].args[j]) + 1;
+		lineLen += 2;
+		for (int j=0; j < stages[i].numRedirects; j++) {
+			char* word = redirectWord(&stages[i].redirects[j]);
+			lineLen += strlen(stages[i].redirects[j].op) + 1;
+			if (word != NULL)
+				lineLen += strlen(word) + 1;
+		}
+	}
+	job->line = (char*)malloc(lineLen + 2);
+	job->pids = (pid_t*)malloc(sizeof(pid_t) * numStages);
+	job->pidfds = (int*)malloc(sizeof(int) * numStages);
+	if (job->line == NULL || job->pids == NULL || job->pidfds == NULL) {
+		//perror("job malloc");
+		djsh_error();
+		exit(1);
+	}
+	c = job->line;
+	for (int i=0; i < numStages; i++) {
+		if (i > 0)
+			c = stpcpy(c, "| ");
+		for (int j=0; stages[i].args[j] != NULL; j++) {
+			c = stpcpy(c, stages[i].args[j]);
+			*c++ = ' ';
+		}
+		for (int j=0; j < stages[i].numRedirects; j++) {
+			char* word = redirectWord(&stages[i].redirects[j]);
+			c = stpcpy(c, stages[i].redirects[j].op);
+			*c++ = ' ';
+			if (word != NULL) {
+				c = stpcpy(c, word);
+				*c++ = ' ';
+			}
+		}
+	}
+	strcpy(c, "&");
+
+	job->output = NULL;
+	job->seq = ++numJobsStarted;
+	jobWatch(job, pids, numStages, jobEpollFd, slot);
+	// A last stage that couldn't be started counts as not found, and the pid shown is the last
+	// one that did start
+	if (pids[numStages-1] < 0)
+		job->status = W_EXITCODE(127, 0);
+	while (pids[last] <= 0)
+		last--;
+	if (!announceJobs)
+		return;
+	printf("[%d] %d\n", slot+1, (int)pids[last]);
+	fflush(stdout);
+}
+
+void jobWatch(struct Job* job, pid_t pids[], int numPids, int epollFd, int slot) {
+	struct epoll_event ev;
+
+	job->numPids = numPids;
+	job->numRunning = 0;
+	job->status = 0;
+	for (int i=0; i < numPids; i++) {
+		job->pids[i] = pids[i];
+		job->pidfds[i] = -1;
+		if (pids[i] <= 0)
+			continue;
+		job->numRunning++;
+		// The pidfd becomes readable when the process exits, so no polling is needed
+		// If either call fails the process is caught by jobTablePoll's WNOHANG pass instead
+		job->pidfds[i] = syscall(SYS_pidfd_open, pids[i], 0);
+		if (job->pidfds[i] < 0)
+			continue;
+		ev.events = EPOLLIN;
+		ev.data.u64 = ((uint64_t)slot << 32) | i;
+		if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, job->pidfds[i], &ev) < 0) {
+			close(job->pidfds[i]);
+			job->pidfds[i] = -1;
+		}
+	}
+	for (int i=0; job->output != NULL && i < 2; i++) {
+		ev.events = EPOLLIN;
+		ev.data.u64 = ((uint64_t)slot << 32) | OUTPUT_TAG | i;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, job->output->streams[i].fd, &ev);
+	}
+}
+
+void jobReap(struct Job* job, int stage, int block, int epollFd) {
+	int status = 0;
+	pid_t reaped;
+
+	if (job->pids[stage] <= 0)
+		return;
+	reaped = waitpid(job->pids[stage], &status, block ? 0 : WNOHANG);
+	// ECHILD means it isn't ours to wait for (eg wait in a pipeline, in a forked copy of the shell),
+	// so it'll never be reaped here and has to count as finished
+	if (reaped == 0 || (reaped < 0 && errno != ECHILD))
+		return;
+	if (stage == job->numPids-1)
+		job->status = status;
+	if (job->pidfds[stage] >= 0) {
+		// Closing isn't enough to take it out of epollFd while a child forked
+		// meanwhile still has a copy, so remove it first
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, job->pidfds[stage], NULL);
+		close(job->pidfds[stage]);
+		job->pidfds[stage] = -1;
+	}
+	job->pids[stage] = -1;
+	job->numRunning--;
+}
+
+void jobsPoll(int timeout) {
+	jobTablePoll(jobs, maxJobs, jobEpollFd, timeout);
+}
+
+void jobTablePoll(struct Job table[], int numSlots, int epollFd, int timeout) {
+	struct epoll_event events[16];
+	int numEvents;
+	int numUnwatched = 0;
+	int numReaped = 0;
+
+	// Processes that couldn't get a pidfd have to be checked on directly
+	for (int i=0; i < numSlots; i++) {
+		if (table[i].line == NULL)
+			continue;
+		for (int j=0; j < table[i].numPids; j++) {
+			if (table[i].pids[j] > 0 && table[i].pidfds[j] < 0) {
+				jobReap(&table[i], j, 0, epollFd);
+				if (table[i].pids[j] > 0)
+					numUnwatched++;
+				else
+					numReaped++;
+			}
+		}
+	}
+	// Something finished already, so there's nothing to wait for, and if anything's left that
+	// nothing will say has exited, don't wait long before checking on it again
+	if (numReaped > 0)
+		timeout = 0;
+	else if (numUnwatched > 0 && (timeout < 0 || timeout > JOB_RECHECK_MS))
+		timeout = JOB_RECHECK_MS;
+	if (epollFd < 0) {
+		if (numUnwatched > 0 && timeout > 0)
+			usleep(timeout * 1000);
+		return;
+	}
+	numEvents = epoll_wait(epollFd, events, 16, timeout);
+	for (int i=0; i < numEvents; i++) {
+		int slot = events[i].data.u64 >> 32;
+		uint32_t stage = (uint32_t)events[i].data.u64;
+		// Don't trust an event for a job that's already gone
+		if (slot >= numSlots || table[slot].line == NULL)
+			continue;
+		if (stage & OUTPUT_TAG) {
+			if (table[slot].output != NULL)
+				outputRead(table[slot].output, stage & 1, epollFd);
+		} else if (stage < (uint32_t)table[slot].numPids) {
+			jobReap(&table[slot], stage, 0, epollFd);
+		}
+	}
+}
+
+void jobFree(struct Job* job) {
+	if (job->output != NULL)
+		outputFree(job->output);
+	job->output = NULL;
+	free(job->line);
+	free(job->pids);
+	free(job->pidfds);
+	job->line = NULL;
+	job->pids = NULL;
+	job->pidfds = NULL;
+}
+
+int jobsNotify(int atPrompt) {
+	int numDone = 0;
+	for (int i=0; i < maxJobs; i++) {
+		if (jobs[i].line == NULL || jobs[i].numRunning > 0)
+			continue;
+		if (numDone++ == 0 && atPrompt)
+			printf("\n");
+		printStatus(i+1, jobs[i].status, jobs[i].line);
+		if (!WIFEXITED(jobs[i].status) || WEXITSTATUS(jobs[i].status) != 0)
+			numJobsFailed++;
+		jobFree(&jobs[i]);
+	}
+	fflush(stdout);
+	return numDone;
+}
+
+void printStatus(int id, int status, char* what) {
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+		printf("[%d] Exit %d\t%s\n", id, WEXITSTATUS(status), what);
+	else if (WIFSIGNALED(status))
+		printf("[%d] Killed by signal %d\t%s\n", id, WTERMSIG(status), what);
+	else
+		printf("[%d] Done\t%s\n", id, what);
+}
+
+void jobsWait(int slot) {
+	for (int i=0; i < maxJobs; i++) {
+		if (jobs[i].line == NULL || (slot >= 0 && i != slot))
+			continue;
+		while (jobs[i].numRunning > 0) {
+			// Without pidfds to wait on, just wait on the process itself
+			if (jobEpollFd < 0) {
+				for (int j=0; j < jobs[i].numPids; j++)
+					jobReap(&jobs[i], j, 1, jobEpollFd);
+			} else {
+				jobsPoll(-1);
+			}
+		}
+		if (!WIFEXITED(jobs[i].status) || WEXITSTATUS(jobs[i].status) != 0)
+			numJobsFailed++;
+		jobFree(&jobs[i]);
+	}
+}
+
+int jobSlot(char* arg) {
+	int slot = -1;
+	if (arg == NULL) {
+		// Freed slots are reused lowest first, so the most recent job is the one started last,
+		// not necessarily the one in the highest slot
+		for (int i=0; i < maxJobs; i++) {
+			if (jobs[i].line != NULL && (slot < 0 || jobs[i].seq > jobs[slot].seq))
+				slot = i;
+		}
+		return slot;
+	}
+	// Accept %n as well as plain n
+	if (arg[0] == '%')
+		arg++;
+	slot = atoi(arg) - 1;
+	if (slot < 0 || slot >= maxJobs || jobs[slot].line == NULL)
+		return -1;
+	return slot;
+}
+
+void waitForInput(const char* prompt) {
+	struct epoll_event ev;
+
+	jobsPoll(0);
+	jobsNotify(0);
+	write(STDOUT_FILENO, prompt, strlen(prompt));
+	if (promptEpollFd < 0)
+		return;
+	// Sit in epoll rather than getline so a job finishing is reported as it happens
+	while (epoll_wait(promptEpollFd, &ev, 1, -1) == 1 && ev.data.fd != STDIN_FILENO) {
+		jobsPoll(0);
+		if (jobsNotify(1) > 0)
+			write(STDOUT_FILENO, prompt, strlen(prompt));
+	}
+}
+
+int runParallel(char* args[]) {
+	long maxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+	int keepOrder = 0;
+	int lineMode = 0;
+	char** cmd;
+	int cmdLen = 0;
+	char** inputs = NULL;
+	int numInputs = 0;
+	int readInputs = 0;  // Changes to 1 if inputs were read from stdin, so need freeing
+	struct JobPool pool;
+	struct Stage stage;
+	int i = 1;
+
+	// Options come first
+	for (; args[i] != NULL && args[i][0] == '-'; i++) {
+		if (strcmp(args[i], "-j") == 0 && args[i+1] != NULL) {
+			maxRunning = atol(args[++i]);
+			if (maxRunning <= 0) {
+				djsh_error();
+				return 1;
+			}
+		} else if (strcmp(args[i], "-k") == 0) {
+			keepOrder = 1;
+		} else if (strcmp(args[i], "-l") == 0) {
+			lineMode = 1;
+		} else {
+			djsh_error();
+			return 1;
+		}
+	}
+	if (maxRunning <= 0)
+		maxRunning = 1;
+	// Then the command, up to the :::
+	cmd = &args[i];
+	while (cmd[cmdLen] != NULL && strcmp(cmd[cmdLen], ":::") != 0)
+		cmdLen++;
+	if (cmdLen == 0) {
+		djsh_error();
+		return 1;
+	}
+	if (cmd[cmdLen] != NULL) {
+		inputs = &cmd[cmdLen+1];
+		while (inputs[numInputs] != NULL)
+			numInputs++;
+	} else {
+		// No ::: so take one input per line of stdin
+		// If that's been redirected, the shell's own buffered input isn't part of it
+		FILE* in = stdinRedirected ? fdopen(dup(STDIN_FILENO), "r") : stdin;
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t nread;
+		int maxInputs = 0;
+		readInputs = 1;
+		while (in != NULL && (nread = getline(&line, &len, in)) != -1) {
+			if (nread > 0 && line[nread-1] == '\n')
+				line[--nread] = '\0';
+			if (numInputs == maxInputs) {
+				maxInputs = maxInputs < 64 ? 64 : maxInputs * 2;
+				inputs = (char**)realloc(inputs, sizeof(char*) * maxInputs);
+				if (inputs == NULL) {
+					//perror("inputs realloc");
+					djsh_error();
+					exit(1);
+				}
+			}
+			inputs[numInputs++] = strdup(line);
+		}
+		free(line);
+		// Leave stdin usable for the next prompt
+		if (in == stdin)
+			clearerr(stdin);
+		else if (in != NULL)
+			fclose(in);
+	}
+
+	stage.args = (char**)malloc(sizeof(char*) * (cmdLen + 2));
+	if (stage.args == NULL) {
+		//perror("parallel malloc");
+		djsh_error();
+		exit(1);
+	}
+	stage.redirects = NULL;
+	stage.numRedirects = 0;
+	// There's never any use running more at once than there are inputs
+	if (maxRunning > numInputs)
+		maxRunning = numInputs > 0 ? numInputs : 1;
+	if (poolInit(&pool, maxRunning, keepOrder, lineMode, 1) < 0) {
+		free(stage.args);
+		if (readInputs) {
+			for (int j=0; j < numInputs; j++)
+				free(inputs[j]);
+			free(inputs);
+		}
+		return 1;
+	}
+
+	for (int next=0; next < numInputs; next++) {
+		int usedInput = 0;
+		for (int j=0; j < cmdLen; j++) {
+			stage.args[j] = substituteArg(cmd[j], inputs[next]);
+			if (stage.args[j] != cmd[j])
+				usedInput = 1;
+		}
+		// Like GNU parallel, the input goes on the end if there was nowhere to put it
+		stage.args[cmdLen] = usedInput ? NULL : inputs[next];
+		stage.args[cmdLen+1] = NULL;
+		poolStart(&pool, &stage, 1, strdup(inputs[next]));
+		for (int j=0; j < cmdLen; j++) {
+			if (stage.args[j] != cmd[j])
+				free(stage.args[j]);
+		}
+	}
+	poolFlush(&pool, 0);
+	printf("parallel: %d jobs, %d failed\n", numInputs, pool.numFailed);
+	fflush(stdout);
+
+	free(pool.ring);
+	if (pool.epollFd >= 0)
+		close(pool.epollFd);
+	free(stage.args);
+	if (readInputs) {
+		for (int j=0; j < numInputs; j++)
+			free(inputs[j]);
+		free(inputs);
+	}
+	return pool.numFailed > 0;
+}
+
+char* substituteArg(char* word, char* input) {
+	size_t inputLen = strlen(input);
+	size_t numSlots = 0;
+	char* result;
+	char* c;
+
+	for (char* found = strstr(word, "{}"); found != NULL; found = strstr(found+2, "{}"))
+		numSlots++;
+	if (numSlots == 0)
+		return word;
+	result = (char*)malloc(strlen(word) + numSlots * inputLen + 1);
+	if (result == NULL) {
+		//perror("substituteArg malloc");
+		djsh_error();
+		exit(1);
+	}
+	c = result;
+	for (char* found; (found = strstr(word, "{}")) != NULL; word = found+2) {
+		memcpy(c, word, found - word);
+		c += found - word;
+		memcpy(c, input, inputLen);
+		c += inputLen;
+	}
+	strcpy(c, word);
+	return result;
+}
+
+int jobDone(struct Job* job) {
+	if (job->numRunning > 0)
+		return 0;
+	return job->output == NULL || (job->output->streams[0].fd < 0 && job->output->streams[1].fd < 0);
+}
+
+struct JobOutput* outputCreate(int id, int lineMode, int writeFds[2]) {
+	struct JobOutput* out = (struct JobOutput*)calloc(1, sizeof(struct JobOutput));
+	int pipeFds[2];
+
+	writeFds[0] = -1;
+	writeFds[1] = -1;
+	if (out == NULL)
+		return NULL;
+	out->id = id;
+	out->lineMode = lineMode;
+	for (int i=0; i < 2; i++) {
+		out->streams[i].fd = -1;
+		out->streams[i].spillFd = -1;
+	}
+	for (int i=0; i < 2; i++) {
+		if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+			if (writeFds[0] >= 0)
+				close(writeFds[0]);
+			outputFree(out);
+			return NULL;
+		}
+		out->streams[i].fd = pipeFds[0];
+		writeFds[i] = pipeFds[1];
+	}
+	return out;
+}
+
+void outputRead(struct JobOutput* out, int stream, int epollFd) {
+	struct OutputStream* s = &out->streams[stream];
+	int toFd = stream == 0 ? STDOUT_FILENO : STDERR_FILENO;
+	char buf[65536];
+	char prefix[16];
+	int prefixLen;
+	ssize_t n = read(s->fd, buf, sizeof(buf));
+	char* start = buf;
+	char* newline;
+
+	if (n <= 0) {
+		// End of file (or nothing more to be had), so this stream is finished
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+		close(s->fd);
+		s->fd = -1;
+		// Give a last unfinished line its own newline so the next line doesn't run into it
+		if (out->lineMode && (s->len > 0 || s->spillLen > 0)) {
+			prefixLen = snprintf(prefix, sizeof(prefix), "[%d] ", out->id);
+			writeAll(toFd, prefix, prefixLen);
+			outputWriteStream(s, toFd);
+			writeAll(toFd, "\n", 1);
+		}
+		return;
+	}
+	if (!out->lineMode) {
+		outputAppend(s, buf, n);
+		return;
+	}
+	// Write out each complete line in one go, with whatever was left over from before in front
+	// of the first, and keep the unfinished end for later
+	prefixLen = snprintf(prefix, sizeof(prefix), "[%d] ", out->id);
+	while ((newline = memchr(start, '\n', buf + n - start)) != NULL) {
+		writeAll(toFd, prefix, prefixLen);
+		outputWriteStream(s, toFd);
+		writeAll(toFd, start, newline + 1 - start);
+		start = newline + 1;
+	}
+	outputAppend(s, start, buf + n - start);
+}
+
+void outputAppend(struct OutputStream* s, const char* data, size_t n) {
+	if (n == 0)
+		return;
+	// Once anything has spilled, everything after it has to follow it there to stay in order
+	if (s->spillFd < 0 && s->len + n <= OUTPUT_BUFFER_MAX) {
+		if (s->len + n > s->cap) {
+			size_t newCap = s->cap < 4096 ? 4096 : s->cap;
+			while (newCap < s->len + n)
+				newCap *= 2;
+			s->data = (char*)realloc(s->data, newCap);
+			if (s->data == NULL) {
+				//perror("output realloc");
+				djsh_error();
+				exit(1);
+			}
+			s->cap = newCap;
+		}
+		memcpy(s->data + s->len, data, n);
+		s->len += n;
+		return;
+	}
+	if (s->spillFd < 0)
+		s->spillFd = memfd_create("djsh-output", MFD_CLOEXEC);
+	if (s->spillFd < 0) {
+		djsh_error();
+		return;
+	}
+	writeAll(s->spillFd, data, n);
+	s->spillLen += n;
+}
+
+void outputWriteStream(struct OutputStream* s, int fd) {
+	writeAll(fd, s->data, s->len);
+	s->len = 0;
+	if (s->spillFd >= 0) {
+		copyFdOut(fd, s->spillFd, s->spillLen);
+		close(s->spillFd);
+		s->spillFd = -1;
+		s->spillLen = 0;
+	}
+}
+
+void outputFree(struct JobOutput* out) {
+	for (int i=0; i < 2; i++) {
+		if (out->streams[i].fd >= 0)
+			close(out->streams[i].fd);
+		if (out->streams[i].spillFd >= 0)
+			close(out->streams[i].spillFd);
+		free(out->streams[i].data);
+	}
+	free(out);
+}
+
+void writeAll(int fd, const char* data, size_t n) {
+	ssize_t written;
+	while (n > 0 && (written = write(fd, data, n)) > 0) {
+		data += written;
+		n -= written;
+	}
+}
+
+void copyFdOut(int toFd, int fromFd, off_t size) {
+	char buf[65536];
+	off_t offset = 0;
+	ssize_t n;
+
+	// Let the kernel copy it straight across, or fall back to reading it through if it can't
+	while (offset < size && (n = sendfile(toFd, fromFd, &offset, size - offset)) > 0);
+	if (offset < size && lseek(fromFd, offset, SEEK_SET) == offset) {
+		while (offset < size && (n = read(fromFd, buf, sizeof(buf))) > 0) {
+			writeAll(toFd, buf, n);
+			offset += n;
+		}
+	}
+}
+
+int poolInit(struct JobPool* pool, int maxRunning, int inOrder, int lineMode, int report) {
+	size_t size;
+	struct rlimit limit;
+	rlim_t fdsSpare;
+
+	if (maxRunning > POOL_MAX_RUNNING)
+		maxRunning = POOL_MAX_RUNNING;
+	// Running more than there are fds for would only leave the rest waiting on fds
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+		fdsSpare = limit.rlim_cur > POOL_FDS_RESERVED + POOL_FDS_PER_JOB ?
+			limit.rlim_cur - POOL_FDS_RESERVED : POOL_FDS_PER_JOB;
+		if ((rlim_t)maxRunning > fdsSpare / POOL_FDS_PER_JOB)
+			maxRunning = fdsSpare / POOL_FDS_PER_JOB;
+	}
+	pool->maxRunning = maxRunning;
+	// Room for finished jobs to wait their turn without holding up the ones behind them
+	size = (size_t)maxRunning * (inOrder ? 4 : 1);
+	pool->ring = (struct Job*)calloc(size, sizeof(struct Job));
+	if (pool->ring == NULL) {
+		//perror("pool calloc");
+		djsh_error();
+		return -1;
+	}
+	pool->size = (int)size;
+	pool->head = 0;
+	pool->numQueued = 0;
+	pool->inOrder = inOrder;
+	pool->lineMode = lineMode;
+	pool->report = report;
+	pool->numFailed = 0;
+	pool->nextId = 1;
+	pool->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	return 0;
+}
+
+void poolStart(struct JobPool* pool, struct Stage stages[], int numStages, char* line) {
+	struct Job* job;
+	struct JobOutput* output = NULL;
+	pid_t* pids;
+	int writeFds[2] = {-1, -1};
+	int numRunning;
+	int slot;
+
+	// Wait for a slot, and for fewer than maxRunning jobs to be running
+	while (1) {
+		poolFlush(pool, pool->size - 1);
+		numRunning = 0;
+		for (int i=0; i < pool->size; i++) {
+			if (pool->ring[i].line != NULL && pool->ring[i].numRunning > 0)
+				numRunning++;
+		}
+		if (numRunning < pool->maxRunning)
+			break;
+		jobTablePoll(pool->ring, pool->size, pool->epollFd, -1);
+	}
+	// Output can only be collected with an epoll set to hear about it on
+	// If its pipes can't be made (most likely out of fds), wait for a job before it to finish
+	// and give its fds back, rather than let its output cut in ahead of theirs
+	while (pool->epollFd >= 0 && (output = outputCreate(pool->nextId, pool->lineMode, writeFds)) == NULL) {
+		if (pool->numQueued == 0) {
+			// Nothing to wait for, so it can only run with its output going straight out
+			djsh_error();
+			break;
+		}
+		poolFlush(pool, pool->numQueued - 1);
+	}
+	if (pool->inOrder) {
+		slot = (pool->head + pool->numQueued) % pool->size;
+	} else {
+		for (slot = 0; pool->ring[slot].line != NULL; slot++);
+	}
+	job = &pool->ring[slot];
+	pids = (pid_t*)malloc(sizeof(pid_t) * numStages);
+	job->line = line;
+	job->pids = (pid_t*)malloc(sizeof(pid_t) * numStages);
+	job->pidfds = (int*)malloc(sizeof(int) * numStages);
+	if (line == NULL || pids == NULL || job->pids == NULL || job->pidfds == NULL) {
+		//perror("pool job malloc");
+		djsh_error();
+		exit(1);
+	}
+	job->id = pool->nextId++;
+	job->output = output;
+	startPipeline(stages, numStages, writeFds[0], writeFds[1], pids);
+	// The children have the write ends now, so the pipes hit end of file once they're all gone
+	for (int i=0; i < 2; i++) {
+		if (writeFds[i] >= 0)
+			close(writeFds[i]);
+	}
+	jobWatch(job, pids, numStages, pool->epollFd, slot);
+	// A command that couldn't be started counts as not found
+	if (pids[numStages-1] < 0)
+		job->status = W_EXITCODE(127, 0);
+	free(pids);
+	pool->numQueued++;
+}
+
+void poolFlush(struct JobPool* pool, int maxQueued) {
+	jobTablePoll(pool->ring, pool->size, pool->epollFd, 0);
+	while (pool->numQueued > 0) {
+		struct Job* job = NULL;
+		if (pool->inOrder) {
+			if (jobDone(&pool->ring[pool->head]))
+				job = &pool->ring[pool->head];
+		} else {
+			for (int i=0; i < pool->size && job == NULL; i++) {
+				if (pool->ring[i].line != NULL && jobDone(&pool->ring[i]))
+					job = &pool->ring[i];
+			}
+		}
+		if (job != NULL) {
+			poolFinish(pool, job);
+			if (pool->inOrder)
+				pool->head = (pool->head + 1) % pool->size;
+			continue;
+		}
+		// Nothing ready, so only wait if there are too many jobs queued
+		if (pool->numQueued <= maxQueued)
+			break;
+		// Without pidfds to wait on, just wait on the processes themselves
+		if (pool->epollFd < 0) {
+			job = &pool->ring[pool->inOrder ? pool->head : 0];
+			for (int i=0; pool->inOrder && i < job->numPids; i++)
+				jobReap(job, i, 1, pool->epollFd);
+			for (int i=0; !pool->inOrder && i < pool->size; i++) {
+				for (int j=0; pool->ring[i].line != NULL && j < pool->ring[i].numPids; j++)
+					jobReap(&pool->ring[i], j, 1, pool->epollFd);
+			}
+		} else {
+			jobTablePoll(pool->ring, pool->size, pool->epollFd, -1);
+		}
+	}
+}
+
+void poolFinish(struct JobPool* pool, struct Job* job) {
+	if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0)
+		pool->numFailed++;
+	// Grouped output all goes out together, line mode output has already gone
+	if (job->output != NULL) {
+		outputWriteStream(&job->output->streams[0], STDOUT_FILENO);
+		outputWriteStream(&job->output->streams[1], STDERR_FILENO);
+	}
+	if (pool->report) {
+		printStatus(job->id, job->status, job->line);
+		fflush(stdout);
+	}
+	jobFree(job);
+	pool->numQueued--;
+}
+
+void runBatch(int maxRunning, int lineMode) {
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t nread;
+	struct ParsedLine parsed = {0};
+	struct JobPool pool;
+	char* lineCopy;
+
+	if (poolInit(&pool, maxRunning, 1, lineMode, 0) < 0)
+		return;
+	while ((nread = getline(&line, &len, stdin)) != -1) {
+		if (nread > 0 && line[nread-1] == '\n') {
+			line[--nread] = '\0';
+			if (nread > 0 && line[nread-1] == '\r')
+				line[--nread] = '\0';
+		}
+		// Keep the line as written before parsing splits it up
+		lineCopy = strdup(line);
+		if (parseLine(line, &parsed) < 0) {
+			djsh_error();
+			free(lineCopy);
+			continue;
+		}
+		if (prepareHereDocs(&parsed, stdin) < 0) {
+			djsh_error();
+			closeHereDocs(&parsed);
+			free(lineCopy);
+			continue;
+		}
+		if (parsed.numStages == 1 && !parsed.background && changesShellState(parsed.stages[0].args[0])) {
+			// A built-in like cd changes what later lines do (and wait is there to be a barrier),
+			// so everything before it has to be finished and written out first
+			// Others (echo, cat) run in a child like any other command
+			free(lineCopy);
+			poolFlush(&pool, 0);
+			runLoneBuiltin(&parsed.stages[0]);
+			closeHereDocs(&parsed);
+			continue;
+		}
+		poolStart(&pool, parsed.stages, parsed.numStages, lineCopy);
+		closeHereDocs(&parsed);
+	}
+	poolFlush(&pool, 0);
+
+	free(line);
+	free(parsed.tokens);
+	free(parsed.stages);
+	free(parsed.redirects);
+	free(pool.ring);
+	if (pool.epollFd >= 0)
+		close(pool.epollFd);
+}
+
+int runScript(char* scriptPath, int maxRunning, int lineMode) {
+	struct ScriptCommand* commands;
+	struct ParsedLine parsed = {0};
+	struct JobPool pool;
+	struct stat st;
+	char* realPath = realpath(scriptPath, NULL);
+	char* cachePath;
+	char* image = NULL;
+	char* data;
+	size_t imageSize;
+	int numCommands;
+	int numFailed = 0;
+	int loaded = 0;
+	int fd;
+
+	if (realPath == NULL || (fd = open(realPath, O_RDONLY | O_CLOEXEC)) < 0) {
+		//perror("script open");
+		djsh_error();
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		djsh_error();
+		close(fd);
+		return -1;
+	}
+	cachePath = scriptCachePath(realPath);
+	if (cachePath != NULL)
+		image = scriptCacheLoad(cachePath, realPath, &st, &imageSize);
+	// One that's damaged in a way its header doesn't show is compiled again just like a stale one
+	if (image != NULL) {
+		loaded = loadScript(image, imageSize, &commands, &numCommands) == 0;
+		if (!loaded) {
+			munmap(image, imageSize);
+			image = NULL;
+		}
+	}
+	if (image == NULL) {
+		// Not compiled yet (or changed since), so map it and parse the whole thing once
+		data = NULL;
+		if (st.st_size > 0) {
+			data = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				//perror("script mmap");
+				djsh_error();
+				close(fd);
+				return -1;
+			}
+		}
+		image = compileScript(data, st.st_size, realPath, &st, &imageSize);
+		if (data != NULL)
+			munmap(data, st.st_size);
+		if (cachePath != NULL)
+			scriptCacheSave(cachePath, image, imageSize);
+	}
+	close(fd);
+	free(cachePath);
+	free(realPath);
+	if (!loaded && loadScript(image, imageSize, &commands, &numCommands) < 0) {
+		djsh_error();
+		return -1;
+	}
+
+	if (maxRunning > 0 && poolInit(&pool, maxRunning, 1, lineMode, 0) < 0)
+		return -1;
+	announceJobs = 0;
+	runningScript = 1;
+	// Whatever runs it (cron, say) needs to hear about any command that failed, so each one counts
+	for (int i=0; i < numCommands && !scriptExited; i++) {
+		struct ScriptCommand* c = &commands[i];
+		if (c->numStages == 0) {
+			// Reported when it's reached, same as if it had been typed
+			djsh_error();
+			numFailed++;
+			continue;
+		}
+		parsed.stages = c->stages;
+		parsed.numStages = c->numStages;
+		parsed.redirects = c->stages[0].redirects;
+		parsed.background = c->background;
+		if (prepareHereDocs(&parsed, NULL) < 0) {
+			djsh_error();
+			numFailed++;
+			closeHereDocs(&parsed);
+			continue;
+		}
+		if (maxRunning > 0 && c->numStages == 1 && !c->background && changesShellState(c->stages[0].args[0])) {
+			// As in batch mode, a built-in that changes the shell waits for everything before it
+			poolFlush(&pool, 0);
+			if (runLoneBuiltin(&c->stages[0]) != 0)
+				numFailed++;
+		} else if (maxRunning > 0) {
+			poolStart(&pool, c->stages, c->numStages, strdup(c->line));
+		} else if (c->numStages == 1 && !c->background && isBuiltin(c->stages[0].args[0])) {
+			// Run one line at a time, any built-in runs right here as if it had been typed
+			if (runLoneBuiltin(&c->stages[0]) != 0)
+				numFailed++;
+		} else if (runPipeline(c->stages, c->numStages, c->background) != 0) {
+			numFailed++;
+		}
+		closeHereDocs(&parsed);
+	}
+	if (maxRunning > 0) {
+		poolFlush(&pool, 0);
+		numFailed += pool.numFailed;
+		free(pool.ring);
+		if (pool.epollFd >= 0)
+			close(pool.epollFd);
+	}
+	// Background jobs still running are part of the script too, and so are their failures
+	jobsWait(-1);
+	return numFailed + numJobsFailed > 0;
+}
+
+char* scriptCachePath(char* realPath) {
+	char* dir = getenv("DJSH_SCRIPT_CACHE");
+	char* base = NULL;
+	char* cachePath;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t len;
+
+	if (dir != NULL && dir[0] == '\0')
+		return NULL;
+	if (dir == NULL) {
+		// Under the usual cache directory otherwise
+		if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+			dir = "/djsh";
+		else if ((base = getenv("HOME")) != NULL)
+			dir = "/.cache/djsh";
+		else
+			return NULL;
+	}
+	// Named by a hash of the path, which is checked against the one inside when it's loaded
+	for (char* c = realPath; *c != '\0'; c++) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ULL;
+	}
+	len = (base != NULL ? strlen(base) : 0) + strlen(dir) + 1 + 16 + 1;
+	cachePath = (char*)malloc(sizeof(char) * len);
+	if (cachePath == NULL)
+		return NULL;
+	snprintf(cachePath, len, "%s%s/%016llx", base != NULL ? base : "", dir, (unsigned long long)hash);
+	return cachePath;
+}
+
+char* scriptCacheLoad(char* cachePath, char* realPath, struct stat* st, size_t* imageSize) {
+	struct ScriptCacheHeader* header;
+	struct stat cacheSt;
+	char* image;
+	char* strings;
+	int fd = open(cachePath, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &cacheSt) < 0 || cacheSt.st_size < (off_t)sizeof(struct ScriptCacheHeader)) {
+		close(fd);
+		return NULL;
+	}
+	// Private and writable so the commands' strings can be used in place like a getline buffer's
+	image = (char*)mmap(NULL, cacheSt.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+	header = (struct ScriptCacheHeader*)image;
+	strings = scriptStrings(image, cacheSt.st_size);
+	if (strings == NULL || header->mtimeSec != st->st_mtim.tv_sec || header->mtimeNsec != st->st_mtim.tv_nsec
+		|| header->size != st->st_size || header->pathLen != strlen(realPath)
+		|| memcmp(strings, realPath, header->pathLen + 1) != 0) {
+		munmap(image, cacheSt.st_size);
+		return NULL;
+	}
+	*imageSize = cacheSt.st_size;
+	return image;
+}
+
+void scriptCacheSave(char* cachePath, char* image, size_t imageSize) {
+	size_t len = strlen(cachePath) + 16;
+	char* tempPath = (char*)malloc(sizeof(char) * len);
+	ssize_t written = 0;
+	int fd;
+
+	// The cache is only ever a shortcut, so failing to save it just means compiling next time too
+	if (tempPath == NULL)
+		return;
+	// Make the directories on the way, ignoring the ones already there
+	strcpy(tempPath, cachePath);
+	for (char* c = tempPath + 1; *c != '\0'; c++) {
+		if (*c == '/') {
+			*c = '\0';
+			mkdir(tempPath, 0700);
+			*c = '/';
+		}
+	}
+	// Written beside it then renamed over it, so a run starting meanwhile never sees half of it
+	snprintf(tempPath, len, "%s.%d", cachePath, (int)getpid());
+	fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		free(tempPath);
+		return;
+	}
+	for (size_t done = 0; done < imageSize; done += written) {
+		if ((written = write(fd, image + done, imageSize - done)) <= 0)
+			break;
+	}
+	if (close(fd) < 0 || written <= 0 || rename(tempPath, cachePath) < 0)
+		unlink(tempPath);
+	free(tempPath);
+}
+
+char* compileScript(char* data, size_t dataSize, char* realPath, struct stat* st, size_t* imageSize) {
+	struct ScriptBuilder b = {0};
+	struct ParsedLine parsed = {0};
+	struct ScriptCacheHeader header;
+	size_t pos = 0;
+	size_t len;
+	char* text;
+	char* image;
+	char* c;
+
+	scriptAddBytes(&b, realPath, strlen(realPath) + 1);
+	while ((text = scriptNextLine(data, dataSize, &pos, &len)) != NULL) {
+		char* line = strndup(text, len);
+		struct CachedCommand* cmd;
+		uint32_t lineOff;
+
+		if (line == NULL) {
+			djsh_error();
+			exit(1);
+		}
+		// A # starting a word comments out the rest of the line, including a #! line
+		for (c = line; *c != '\0'; c++) {
+			if (*c == '#' && (c == line || isWhiteSpace(c[-1]))) {
+				*c = '\0';
+				break;
+			}
+		}
+		for (c = line; isWhiteSpace(*c); c++);
+		if (*c == '\0') {
+			free(line);
+			continue;
+		}
+		len = strlen(line);
+		lineOff = scriptAddBytes(&b, line, len + 1);
+		b.commands = (struct CachedCommand*)growArray(b.commands, &b.maxCommands, b.numCommands + 1,
+			sizeof(struct CachedCommand));
+		cmd = &b.commands[b.numCommands++];
+		cmd->line = lineOff;
+		cmd->firstStage = b.numStages;
+		cmd->numStages = 0;
+		cmd->background = 0;
+		if (parseLine(line, &parsed) < 0) {
+			free(line);
+			continue;
+		}
+		cmd->numStages = parsed.numStages;
+		cmd->background = parsed.background;
+
+		// Keep the line as parseLine left it, so everything parsed can be found by its offset
+		uint32_t tokensOff = scriptAddBytes(&b, line, len + 1);
+		for (int i=0; i < parsed.numStages; i++) {
+			struct Stage* stage = &parsed.stages[i];
+			b.stages = (struct CachedStage*)growArray(b.stages, &b.maxStages, b.numStages + 1,
+				sizeof(struct CachedStage));
+			b.stages[b.numStages].firstArg = b.numArgs;
+			b.stages[b.numStages].firstRedirect = b.numRedirects;
+			b.stages[b.numStages].numRedirects = stage->numRedirects;
+			b.numStages++;
+			for (int j=0; ; j++) {
+				b.args = (uint32_t*)growArray(b.args, &b.maxArgs, b.numArgs + 1, sizeof(uint32_t));
+				b.args[b.numArgs++] = stage->args[j] != NULL ? tokensOff + (stage->args[j] - line) : NO_STRING;
+				if (stage->args[j] == NULL)
+					break;
+			}
+			for (int j=0; j < stage->numRedirects; j++) {
+				struct Redirect* r = &stage->redirects[j];
+				struct CachedRedirect* cr;
+				b.redirects = (struct CachedRedirect*)growArray(b.redirects, &b.maxRedirects,
+					b.numRedirects + 1, sizeof(struct CachedRedirect));
+				cr = &b.redirects[b.numRedirects++];
+				cr->op = tokensOff + (r->op - line);
+				cr->filename = r->filename != NULL ? tokensOff + (r->filename - line) : NO_STRING;
+				cr->here = r->here != NULL ? tokensOff + (r->here - line) : NO_STRING;
+				cr->body = NO_STRING;
+				cr->fd = r->fd;
+				cr->flags = r->flags;
+				cr->dupFd = r->dupFd;
+				cr->hereType = r->hereType;
+				if (r->hereType != 'd')
+					continue;
+				// A here-document's body is the lines that follow, so it's stored with it
+				cr->body = b.stringsSize;
+				while ((text = scriptNextLine(data, dataSize, &pos, &len)) != NULL) {
+					if (len == strlen(r->here) && memcmp(text, r->here, len) == 0)
+						break;
+					scriptAddBytes(&b, text, len);
+					scriptAddBytes(&b, "\n", 1);
+				}
+				scriptAddBytes(&b, "", 1);
+			}
+		}
+		free(line);
+	}
+
+	memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+	header.mtimeSec = st->st_mtim.tv_sec;
+	header.mtimeNsec = st->st_mtim.tv_nsec;
+	header.size = st->st_size;
+	header.pathLen = strlen(realPath);
+	header.numCommands = b.numCommands;
+	header.numStages = b.numStages;
+	header.numArgs = b.numArgs;
+	header.numRedirects = b.numRedirects;
+	header.stringsSize = b.stringsSize;
+	*imageSize = sizeof(header) + sizeof(struct CachedCommand) * b.numCommands
+		+ sizeof(struct CachedStage) * b.numStages + sizeof(uint32_t) * b.numArgs
+		+ sizeof(struct CachedRedirect) * b.numRedirects + b.stringsSize;
+	image = (char*)malloc(*imageSize);
+	if (image == NULL) {
+		//perror("script image malloc");
+		djsh_error();
+		exit(1);
+	}
+	c = image;
+	memcpy(c, &header, sizeof(header));
+	c += sizeof(header);
+	memcpy(c, b.commands, sizeof(struct CachedCommand) * b.numCommands);
+	c += sizeof(struct CachedCommand) * b.numCommands;
+	memcpy(c, b.stages, sizeof(struct CachedStage) * b.numStages);
+	c += sizeof(struct CachedStage) * b.numStages;
+	memcpy(c, b.args, sizeof(uint32_t) * b.numArgs);
+	c += sizeof(uint32_t) * b.numArgs;
+	memcpy(c, b.redirects, sizeof(struct CachedRedirect) * b.numRedirects);
+	c += sizeof(struct CachedRedirect) * b.numRedirects;
+	memcpy(c, b.strings, b.stringsSize);
+
+	free(b.commands);
+	free(b.stages);
+	free(b.args);
+	free(b.redirects);
+	free(b.strings);
+	free(parsed.tokens);
+	free(parsed.stages);
+	free(parsed.redirects);
+	return image;
+}
+
+char* scriptStrings(char* image, size_t imageSize) {
+	struct ScriptCacheHeader* header = (struct ScriptCacheHeader*)image;
+	uint64_t expected;
+
+	if (imageSize < sizeof(*header) || memcmp(header->magic, SCRIPT_CACHE_MAGIC, sizeof(header->magic)) != 0)
+		return NULL;
+	expected = sizeof(*header) + sizeof(struct CachedCommand) * (uint64_t)header->numCommands
+		+ sizeof(struct CachedStage) * (uint64_t)header->numStages
+		+ sizeof(uint32_t) * (uint64_t)header->numArgs
+		+ sizeof(struct CachedRedirect) * (uint64_t)header->numRedirects + header->stringsSize;
+	// Every string has to end inside them, the path included
+	if (expected != imageSize || header->stringsSize == 0 || image[imageSize-1] != '\0'
+		|| header->pathLen >= header->stringsSize)
+		return NULL;
+	return image + imageSize - header->stringsSize;
+}
+
+int loadScript(char* image, size_t imageSize, struct ScriptCommand** commands, int* numCommands) {
+	struct ScriptCacheHeader* header = (struct ScriptCacheHeader*)image;
+	char* strings = scriptStrings(image, imageSize);
+	struct CachedCommand* cachedCommands;
+	struct CachedStage* cachedStages;
+	uint32_t* cachedArgs;
+	struct CachedRedirect* cachedRedirects;
+	struct Stage* stages;
+	char** args;
+	struct Redirect* redirects;
+	uint32_t stringsSize;
+
+	if (strings == NULL)
+		return -1;
+	stringsSize = header->stringsSize;
+	cachedCommands = (struct CachedCommand*)(image + sizeof(*header));
+	cachedStages = (struct CachedStage*)(cachedCommands + header->numCommands);
+	cachedArgs = (uint32_t*)(cachedStages + header->numStages);
+	cachedRedirects = (struct CachedRedirect*)(cachedArgs + header->numArgs);
+
+	// One more of each so nothing is ever a malloc of 0
+	*commands = (struct ScriptCommand*)malloc(sizeof(struct ScriptCommand) * (header->numCommands + 1));
+	stages = (struct Stage*)malloc(sizeof(struct Stage) * (header->numStages + 1));
+	args = (char**)malloc(sizeof(char*) * (header->numArgs + 1));
+	redirects = (struct Redirect*)malloc(sizeof(struct Redirect) * (header->numRedirects + 1));
+	if (*commands == NULL || stages == NULL || args == NULL || redirects == NULL) {
+		//perror("script malloc");
+		djsh_error();
+		exit(1);
+	}
+
+	// Only pointers need filling in, the parsing having been done when it was compiled
+	if (header->numArgs > 0 && cachedArgs[header->numArgs-1] != NO_STRING)
+		goto fail;
+	for (uint32_t i=0; i < header->numArgs; i++) {
+		if (cachedArgs[i] != NO_STRING && cachedArgs[i] >= stringsSize)
+			goto fail;
+		args[i] = cachedArgs[i] != NO_STRING ? strings + cachedArgs[i] : NULL;
+	}
+	for (uint32_t i=0; i < header->numRedirects; i++) {
+		struct CachedRedirect* cr = &cachedRedirects[i];
+		struct Redirect* r = &redirects[i];
+		// Each kind needs what it's run with: a file, an fd to copy, or a here word (and a body
+		// for a here-document)
+		if ((cr->hereType == 0 && cr->filename == NO_STRING && cr->dupFd < 0)
+			|| (cr->hereType != 0 && cr->hereType != 'd' && cr->hereType != 's')
+			|| (cr->hereType != 0 && cr->here == NO_STRING)
+			|| (cr->hereType == 'd' && cr->body == NO_STRING))
+			goto fail;
+		if (cr->op >= stringsSize || (cr->filename != NO_STRING && cr->filename >= stringsSize)
+			|| (cr->here != NO_STRING && cr->here >= stringsSize)
+			|| (cr->body != NO_STRING && cr->body >= stringsSize))
+			goto fail;
+		r->op = strings + cr->op;
+		r->filename = cr->filename != NO_STRING ? strings + cr->filename : NULL;
+		r->here = cr->here != NO_STRING ? strings + cr->here : NULL;
+		r->body = cr->body != NO_STRING ? strings + cr->body : NULL;
+		r->fd = cr->fd;
+		r->flags = cr->flags;
+		r->dupFd = cr->dupFd;
+		r->savedFd = -1;
+		r->hereType = (char)cr->hereType;
+	}
+	for (uint32_t i=0; i < header->numStages; i++) {
+		struct CachedStage* cs = &cachedStages[i];
+		if (cs->firstArg >= header->numArgs || args[cs->firstArg] == NULL
+			|| cs->firstRedirect > header->numRedirects
+			|| cs->numRedirects > header->numRedirects - cs->firstRedirect)
+			goto fail;
+		stages[i].args = &args[cs->firstArg];
+		stages[i].redirects = &redirects[cs->firstRedirect];
+		stages[i].numRedirects = cs->numRedirects;
+	}
+	for (uint32_t i=0; i < header->numCommands; i++) {
+		struct CachedCommand* cc = &cachedCommands[i];
+		struct ScriptCommand* c = &(*commands)[i];
+		if (cc->line >= stringsSize || cc->firstStage > header->numStages
+			|| cc->numStages > header->numStages - cc->firstStage)
+			goto fail;
+		// Running a command treats its stages' redirections as one run of them
+		for (uint32_t j=1; j < cc->numStages; j++) {
+			if (cachedStages[cc->firstStage+j].firstRedirect != cachedStages[cc->firstStage+j-1].firstRedirect
+				+ cachedStages[cc->firstStage+j-1].numRedirects)
+				goto fail;
+		}
+		c->line = strings + cc->line;
+		c->stages = &stages[cc->firstStage];
+		c->numStages = cc->numStages;
+		c->background = cc->background;
+	}
+	*numCommands = header->numCommands;
+	return 0;
+fail:
+	free(*commands);
+	free(stages);
+	free(args);
+	free(redirects);
+	return -1;
+}
+
+char* scriptNextLine(char* data, size_t dataSize, size_t* pos, size_t* len) {
+	char* line = data + *pos;
+	char* end;
+
+	if (*pos >= dataSize)
+		return NULL;
+	end = (char*)memchr(line, '\n', dataSize - *pos);
+	if (end == NULL)
+		end = data + dataSize;
+	*pos = end - data + 1;
+	if (end > line && end[-1] == '\r')
+		end--;
+	*len = end - line;
+	return line;
+}
+
+uint32_t scriptAddBytes(struct ScriptBuilder* b, const char* data, size_t len) {
+	uint32_t off = b->stringsSize;
+	b->strings = (char*)growArray(b->strings, &b->maxStrings, b->stringsSize + len, sizeof(char));
+	memcpy(b->strings + off, data, len);
+	b->stringsSize += len;
+	return off;
+}
+
+void* growArray(void* array, int* max, int needed, size_t size) {
+	if (needed <= *max)
+		return array;
+	while (*max < needed)
+		*max = *max < 16 ? 16 : *max * 2;
+	array = realloc(array, size * *max);
+	if (array == NULL) {
+		//perror("growArray realloc");
+		djsh_error();
+		exit(1);
+	}
+	return array;
+}
+
+int setupChildFds(int inFd, int outFd, int errFd, struct Stage* stage) {
+	if (inFd >= 0 && dup2(inFd, STDIN_FILENO) < 0)
+		return -1;
+	if (outFd >= 0 && dup2(outFd, STDOUT_FILENO) < 0)
+		return -1;
+	if (errFd >= 0 && dup2(errFd, STDERR_FILENO) < 0)
+		return -1;
+	// This process is about to become the command, so nothing needs saving
+	return applyRedirects(stage->redirects, stage->numRedirects, 0);
+}
+
+int isWhiteSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+char* scanWhiteSpace(char* c, char* end, int skipping) {
+	unsigned int mask;
+#if defined(__AVX2__)
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i carriage = _mm256_set1_epi8('\r');
+	while (end - c >= 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i*)c);
+		// one bit per byte that's any of the four whitespace characters
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(bytes, space), _mm256_cmpeq_epi8(bytes, tab)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline), _mm256_cmpeq_epi8(bytes, carriage))));
+		if (skipping)
+			mask = ~mask;
+		if (mask != 0)
+			return c + __builtin_ctz(mask);
+		c += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i carriage = _mm_set1_epi8('\r');
+	while (end - c >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)c);
+		// one bit per byte that's any of the four whitespace characters
+		mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(bytes, tab)),
+			_mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, carriage))));
+		if (skipping)
+			mask = ~mask & 0xFFFF;
+		if (mask != 0)
+			return c + __builtin_ctz(mask);
+		c += 16;
+	}
+#endif
+	// Scalar fallback, and the tail that's too short for a full vector
+	while (c < end && isWhiteSpace(*c) == skipping)
+		c++;
+	(void)mask;
+	return c;
+}
+
+int tokenizeLine(char* line, char*** tokens, int* maxTokens) {
+	int numTokens = 0;
+	char* c = line;
+	char* end = line + strlen(line);
+	while (1) {
+		// skip the whitespace before the next token
+		c = scanWhiteSpace(c, end, 1);
+		if (c == end)
+			break;
+		// double the array when full, keeping a spot for the NULL terminator
+		if (numTokens + 1 >= *maxTokens) {
+			int newMax = *maxTokens < 8 ? 8 : *maxTokens * 2;
+			char** newTokens = (char**)realloc(*tokens, sizeof(char*) * newMax);
+			if (newTokens == NULL) {
+				//perror("tokens realloc");
+				djsh_error();
+				exit(1);
+			}
+			*tokens = newTokens;
+			*maxTokens = newMax;
+		}
+		(*tokens)[numTokens++] = c;
+		// find the end of this token and terminate it in place
+		c = scanWhiteSpace(c, end, 0);
+		if (c == end)
+			break;
+		*c++ = '\0';
+	}
+	// make sure there's room for the NULL even on a blank line
+	if (*maxTokens == 0) {
+		*tokens = (char**)malloc(sizeof(char*) * 8);
+		if (*tokens == NULL) {
+			djsh_error();
+			exit(1);
+		}
+		*maxTokens = 8;
+	}
+	(*tokens)[numTokens] = NULL;
+	return numTokens;
+}
+
+int argsTooLong(char* args[]) {
+	// The kernel counts every string plus its pointer, for argv and envp alike
+	long total = 0;
+	long argMax = sysconf(_SC_ARG_MAX);
+	if (argMax <= 0)
+		return 0;
+	for (int i=0; args[i] != NULL; i++)
+		total += strlen(args[i]) + 1 + sizeof(char*);
+	for (int i=0; environ[i] != NULL; i++)
+		total += strlen(environ[i]) + 1 + sizeof(char*);
+	return total > argMax;
+}
+
+int isBuiltin(char* cmd) {
+	return findBuiltin(cmd) != NULL;
+}
+
+int changesShellState(char* cmd) {
+	const struct Builtin* builtin = findBuiltin(cmd);
+	return builtin != NULL && builtin->changesState;
+}
+
+const struct Builtin* findBuiltin(char* name) {
+	// The perfect hash gives each built-in its own slot, so one comparison settles it
+	int i = builtinSlots[builtinNameHash(name, BUILTIN_HASH_SEED) & ((1 << BUILTIN_TABLE_BITS) - 1)];
+	if (i >= 0 && strcmp(builtins[i].name, name) == 0)
+		return &builtins[i];
+	return NULL;
+}
+
+pid_t spawnCommand(char* cmdPath, char* args[], int inFd, int outFd, int errFd, struct Stage* stage) {
+	// glibc implements posix_spawn with clone(CLONE_VM|CLONE_VFORK), so the
+	// parent's page tables are never copied no matter how big djsh has grown
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int err;
+
+	if (posix_spawn_file_actions_init(&actions) != 0)
+		return -1;
+	// Hook up the pipes, then have the child do the redirections itself in order
+	if ((inFd >= 0 && posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO) != 0)
+		|| (outFd >= 0 && posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO) != 0)
+		|| (errFd >= 0 && posix_spawn_file_actions_adddup2(&actions, errFd, STDERR_FILENO) != 0)) {
+		posix_spawn_file_actions_destroy(&actions);
+		return -1;
+	}
+	for (int i=0; i < stage->numRedirects; i++) {
+		struct Redirect* r = &stage->redirects[i];
+		if (r->filename != NULL)
+			err = posix_spawn_file_actions_addopen(&actions, r->fd, r->filename, r->flags, 0666);
+		else
+			err = posix_spawn_file_actions_adddup2(&actions, r->dupFd, r->fd);
+		if (err != 0) {
+			posix_spawn_file_actions_destroy(&actions);
+			return -1;
+		}
+	}
+	err = posix_spawn(&pid, cmdPath, &actions, NULL, args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err != 0)
+		return -1;
+	return pid;
+}
+
+void djsh_error() {
+	char error_message[] = "An error has occurred (from DJ)\n";
+	write(STDERR_FILENO, error_message, strlen(error_message));
+}
+
+char* checkPath(char* cmd) {
+	char* curPath;
+	int nameLen;
+	int first = 0;  // First directory worth checking
+	int last = numPathDirs;  // One past the last directory worth checking
+	int indexed = 0;  // 1 if the index already says which directory has it
+
+	// With an up-to-date index the answer, found or not, comes straight from memory
+	if (indexValid || (!indexFailed && buildPathIndex())) {
+		struct IndexEntry* entry = pathIndexFind(cmd);
+		// A miss is only believed once the directories are known not to have changed
+		if (entry == NULL && pathDirsChanged() && buildPathIndex())
+			entry = pathIndexFind(cmd);
+		if (entry == NULL)
+			return NULL;
+		first = entry->dir;
+		last = entry->dir + 1;
+		indexed = 1;
+	}
+	for (int i=first; i < last; i++) {
+		// Directories that couldn't be opened before (or were closed by cd) get another try
+		if (!indexed && pathDirs[i].fd < 0)
+			pathDirs[i].fd = open(pathDirs[i].name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (!indexed && pathDirs[i].fd < 0)
+			continue;
+		// Check if cmd is executable inside this directory, without building its full path
+		if (indexed || isExecutable(pathDirs[i].fd, cmd, DT_UNKNOWN)) {
+			// Only now put the full path together, since that's what gets exec'd
+			nameLen = strlen(pathDirs[i].name);
+			curPath = (char*)malloc(sizeof(char) * (nameLen + 1 + strlen(cmd) + 1));
+			if (curPath == NULL) {
+				//perror("curPath malloc");
+				djsh_error();
+				exit(1);
+			}
+			strcpy(curPath, pathDirs[i].name);
+			// add / to end if not already
+			if (curPath[nameLen-1] != '/')
+				strcat(curPath, "/");
+			strcat(curPath, cmd);
 			return curPath;
 		}
-		nextToken = strtok(NULL, ":");
-		// free dynamically allocated memory before continuing
-		free(curPath);
 	}
-	
-	// No valid path found, return error value
-	return "0";
+	
+	// No valid path found, return error value
+	return NULL;
+}
+
+void setPathDirs(char* path) {
+	char* pathCopy;
+	char* savePtr = NULL;
+	char* nextToken;
+	int maxDirs = 1;
+
+	// First close and forget the old directories
+	for (int i=0; i < numPathDirs; i++) {
+		if (pathDirs[i].fd >= 0)
+			close(pathDirs[i].fd);
+		free(pathDirs[i].name);
+	}
+	free(pathDirs);
+	pathDirs = NULL;
+	numPathDirs = 0;
+	// A new path gets a fresh chance at being indexed
+	indexFailed = 0;
+
+	// There can't be more directories than colons + 1
+	for (int i=0; path[i] != '\0'; i++) {
+		if (path[i] == ':')
+			maxDirs++;
+	}
+	pathDirs = (struct PathDir*)calloc(maxDirs, sizeof(struct PathDir));
+	pathCopy = (char*)malloc(sizeof(char) * (strlen(path) + 1));
+	if (pathDirs == NULL || pathCopy == NULL) {
+		//perror("pathDirs malloc");
+		djsh_error();
+		exit(1);
+	}
+	strcpy(pathCopy, path);
+	// Tokenize a copy so the path string itself can still be printed
+	nextToken = strtok_r(pathCopy, ":", &savePtr);
+	while (nextToken != NULL) {
+		pathDirs[numPathDirs].name = (char*)malloc(sizeof(char) * (strlen(nextToken) + 1));
+		if (pathDirs[numPathDirs].name == NULL) {
+			djsh_error();
+			exit(1);
+		}
+		strcpy(pathDirs[numPathDirs].name, nextToken);
+		// O_PATH only pins the directory for lookups, it doesn't need read permission
+		pathDirs[numPathDirs].fd = open(nextToken, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		numPathDirs++;
+		nextToken = strtok_r(NULL, ":", &savePtr);
+	}
+	free(pathCopy);
+}
+
+int closeRelativePathDirs() {
+	int closed = 0;
+	for (int i=0; i < numPathDirs; i++) {
+		if (pathDirs[i].name[0] != '/') {
+			if (pathDirs[i].fd >= 0)
+				close(pathDirs[i].fd);
+			// checkPath reopens it relative to the new directory when it's next needed
+			pathDirs[i].fd = -1;
+			closed = 1;
+			indexFailed = 0;
+		}
+	}
+	return closed;
+}
+
+void histInit() {
+	char* setting = getenv("HISTSIZE");
+	char* end;
+	long size;
+	if (setting == NULL)
+		return;
+	size = strtol(setting, &end, 10);
+	if (*setting == '\0' || *end != '\0' || size < 1 || size > HIST_MAX_SIZE) {
+		// Not a usable size, so stick with the default
+		djsh_error();
+		return;
+	}
+	histSize = size;
+}
+
+// Return the record at off in the history arena
+#define HIST_RECORD(off) ((struct HistRecord*)(histArena + (off)))
+// Return the bytes a record for a command of length len takes up in the arena
+#define HIST_RECORD_SIZE(len) ((sizeof(struct HistRecord) + (len) + 1 + 3) & ~(size_t)3)
+
+void histAdd(char* cmd) {
+	long newRingSize;
+	uint32_t* newRing;
+
+	uint32_t off;
+
+	// Too big to keep even on its own, so don't throw away the rest of history making room for it
+	if (HIST_RECORD_SIZE(strlen(cmd)) > HIST_ARENA_MAX) {
+		djsh_error();
+		return;
+	}
+	// History is full, so evict the oldest entry
+	if (numHistory == histSize)
+		histEvict();
+	// Only a ring that has never been full grows, so histStart is still 0 here
+	if (numHistory == histRingSize) {
+		newRingSize = histRingSize < 32 ? 64 : histRingSize * 2;
+		if (newRingSize > histSize)
+			newRingSize = histSize;
+		newRing = (uint32_t*)realloc(histRing, sizeof(uint32_t) * newRingSize);
+		if (newRing == NULL) {
+			//perror("history ring realloc");
+			djsh_error();
+			exit(1);
+		}
+		histRing = newRing;
+		histRingSize = newRingSize;
+	}
+	// A huge HISTSIZE of long, distinct commands can fill the arena before the ring,
+	// in which case the oldest entries make way, rather than the shell giving up
+	while ((off = histIntern(cmd)) == HIST_NONE)
+		histEvict();
+	histRing[(histStart + numHistory) % histRingSize] = off;
+	numHistory++;
+	// Once there's an index, keep it up to date so searches never have to rescan
+	if (histIndexBuilt)
+		histIndexAdd(histSeqBase + numHistory - 1, cmd);
+	if (histTrieBuilt)
+		histTrieAdd(histSeqBase + numHistory - 1, cmd);
+}
+
+void histEvict() {
+	histRelease(histRing[histStart]);
+	histStart = (histStart + 1) % histRingSize;
+	numHistory--;
+	histSeqBase++;
+	histIndexEvictions++;
+	histTrieEvictions++;
+}
+
+char* histGet(long i) {
+	return histArena + histRing[(histStart + i) % histRingSize] + sizeof(struct HistRecord);
+}
+
+void histPrint(long numEntries) {
+	char buf[65536];
+	size_t used = 0;
+	struct HistRecord* rec;
+	if (numEntries > numHistory)
+		numEntries = numHistory;
+	// Jump straight to the first entry wanted, and gather the output into big writes
+	for (long i = numHistory - numEntries; i < numHistory; i++) {
+		rec = HIST_RECORD(histRing[(histStart + i) % histRingSize]);
+		if (used + rec->len + 1 > sizeof(buf)) {
+			write(STDOUT_FILENO, buf, used);
+			used = 0;
+		}
+		if (rec->len + 1 > sizeof(buf)) {
+			// Too big for the buffer, so it gets its own write
+			write(STDOUT_FILENO, histGet(i), rec->len);
+			write(STDOUT_FILENO, "\n", sizeof(char));
+		} else {
+			memcpy(buf + used, histGet(i), rec->len);
+			buf[used + rec->len] = '\n';
+			used += rec->len + 1;
+		}
+	}
+	if (used > 0)
+		write(STDOUT_FILENO, buf, used);
+}
+
+void histSearch(char* pattern, int newestOnly) {
+	int anchored = pattern[0] == '^';
+	char* text = pattern + anchored;  // what has to appear in the entry
+	size_t textLen = strlen(text);
+	struct HistPosting* posting;
+	struct HistPosting* shortest = NULL;
+	uint32_t trigram;
+	uint32_t first;  // first posting still in history
+	long i;
+	long count;  // how many candidates to check
+	char* cmd;
+
+	if (textLen >= 3) {
+		// (Re)build the index if there isn't one or it's mostly evicted entries by now
+		if (!histIndexBuilt || histIndexEvictions > histSize) {
+			histIndexReset();
+			histIndexBuilt = 1;
+			histIndexBase = histSeqBase;
+			for (i=0; i < numHistory; i++)
+				histIndexAdd(histSeqBase + i, histGet(i));
+		}
+		// Every trigram of the pattern has to be in a match, so the rarest one
+		// gives the shortest list of candidates
+		for (size_t j=0; j+2 < textLen; j++) {
+			trigram = ((unsigned char)text[j] << 16) | ((unsigned char)text[j+1] << 8)
+				| (unsigned char)text[j+2];
+			posting = histIndexFind(trigram, 0);
+			if (posting == NULL)
+				return;  // no entry has it
+			if (shortest == NULL || posting->count < shortest->count)
+				shortest = posting;
+		}
+		// Skip past the postings for entries that have been evicted since
+		uint32_t lo = 0, hi = shortest->count;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (shortest->seqs[mid] + histIndexBase < histSeqBase)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		first = lo;
+		count = shortest->count - first;
+	} else {
+		// Too short for a trigram, so every entry is a candidate
+		count = numHistory;
+		first = 0;
+	}
+
+	for (long k=0; k < count; k++) {
+		// Walk the candidates from the newest when only the newest match is wanted
+		long n = newestOnly ? count - 1 - k : k;
+		if (textLen >= 3)
+			i = shortest->seqs[first + n] + histIndexBase - histSeqBase;
+		else
+			i = n;
+		// history -r would always find its own line otherwise
+		if (newestOnly && histSeqBase + i == histCurrentSeq)
+			continue;
+		cmd = histGet(i);
+		if (anchored ? strncmp(cmd, text, textLen) == 0 : strstr(cmd, text) != NULL) {
+			write(STDOUT_FILENO, cmd, strlen(cmd));
+			write(STDOUT_FILENO, "\n", sizeof(char));
+			if (newestOnly)
+				return;
+		}
+	}
+}
+
+void histIndexAdd(long seq, char* cmd) {
+	struct HistPosting* posting;
+	uint32_t trigram;
+	uint32_t* newSeqs;
+	uint32_t rel = seq - histIndexBase;
+	size_t len = strlen(cmd);
+	for (size_t j=0; j+2 < len; j++) {
+		trigram = ((unsigned char)cmd[j] << 16) | ((unsigned char)cmd[j+1] << 8)
+			| (unsigned char)cmd[j+2];
+		posting = histIndexFind(trigram, 1);
+		// A trigram that repeats within the entry only gets listed once
+		if (posting->count > 0 && posting->seqs[posting->count-1] == rel)
+			continue;
+		if (posting->count == posting->cap) {
+			newSeqs = (uint32_t*)realloc(posting->seqs, sizeof(uint32_t) * posting->cap * 2);
+			if (newSeqs == NULL) {
+				//perror("history index realloc");
+				djsh_error();
+				exit(1);
+			}
+			posting->seqs = newSeqs;
+			posting->cap *= 2;
+		}
+		posting->seqs[posting->count++] = rel;
+	}
+}
+
+struct HistPosting* histIndexFind(uint32_t trigram, int create) {
+	size_t slot;
+	struct HistPosting* oldIndex;
+	size_t oldSize;
+
+	if (histIndexSize > 0) {
+		for (slot = (trigram * 2654435761u) & (histIndexSize-1); histIndex[slot].cap != 0;
+				slot = (slot + 1) & (histIndexSize-1)) {
+			if (histIndex[slot].trigram == trigram)
+				return &histIndex[slot];
+		}
+	}
+	if (!create)
+		return NULL;
+
+	// Keep the table at most half full, moving every list over when it grows
+	if ((histIndexUsed + 1) * 2 > histIndexSize) {
+		oldIndex = histIndex;
+		oldSize = histIndexSize;
+		histIndexSize = oldSize < 256 ? 256 : oldSize * 2;
+		histIndex = (struct HistPosting*)calloc(histIndexSize, sizeof(struct HistPosting));
+		if (histIndex == NULL) {
+			//perror("history index calloc");
+			djsh_error();
+			exit(1);
+		}
+		for (size_t i=0; i < oldSize; i++) {
+			if (oldIndex[i].cap == 0)
+				continue;
+			for (slot = (oldIndex[i].trigram * 2654435761u) & (histIndexSize-1);
+					histIndex[slot].cap != 0; slot = (slot + 1) & (histIndexSize-1));
+			histIndex[slot] = oldIndex[i];
+		}
+		free(oldIndex);
+	}
+	for (slot = (trigram * 2654435761u) & (histIndexSize-1); histIndex[slot].cap != 0;
+			slot = (slot + 1) & (histIndexSize-1));
+	histIndex[slot].trigram = trigram;
+	histIndex[slot].count = 0;
+	histIndex[slot].cap = 4;
+	histIndex[slot].seqs = (uint32_t*)malloc(sizeof(uint32_t) * 4);
+	if (histIndex[slot].seqs == NULL) {
+		djsh_error();
+		exit(1);
+	}
+	histIndexUsed++;
+	return &histIndex[slot];
+}
+
+void histIndexReset() {
+	for (size_t i=0; i < histIndexSize; i++)
+		free(histIndex[i].seqs);
+	free(histIndex);
+	histIndex = NULL;
+	histIndexSize = 0;
+	histIndexUsed = 0;
+	histIndexBuilt = 0;
+	histIndexEvictions = 0;
+}
+
+int histExpand(char* line, char** expanded) {
+	char* out = NULL;
+	size_t outUsed = 0;
+	size_t outSize = 0;
+	char* c = line;
+	char* start;  // where the text being copied to out begins
+	char* entry;
+	char* end;
+	long i;
+	long n;
+
+	while (*c != '\0') {
+		// Find the next reference: a ! that isn't followed by whitespace, = or the end
+		if (c[0] != '!' || c[1] == '\0' || c[1] == '=' || isWhiteSpace(c[1])) {
+			start = c++;
+			entry = NULL;
+		} else {
+			start = c + 1;
+			if (c[1] == '!') {  // !!
+				i = numHistory - 1;
+				c += 2;
+			} else if (c[1] == '-' || (c[1] >= '0' && c[1] <= '9')) {  // !n or !-n
+				n = strtol(c + 1, &end, 10);
+				if (end == c + 1 || (c[1] == '-' && end == c + 2)) {
+					free(out);
+					return -1;
+				}
+				i = n < 0 ? numHistory + n : n - 1;
+				c = end;
+			} else {  // !prefix, up to the next whitespace
+				end = c + 1;
+				while (*end != '\0' && !isWhiteSpace(*end))
+					end++;
+				i = histFindPrefix(c + 1, end - (c + 1));
+				c = end;
+			}
+			if (i < 0 || i >= numHistory) {
+				free(out);
+				return -1;
+			}
+			entry = histGet(i);
+		}
+		// Append either the plain character or the whole entry
+		size_t addLen = entry == NULL ? 1 : strlen(entry);
+		if (outUsed + addLen + 1 > outSize) {
+			outSize = (outUsed + addLen + 1) * 2;
+			char* newOut = (char*)realloc(out, outSize);
+			if (newOut == NULL) {
+				//perror("history expansion realloc");
+				djsh_error();
+				exit(1);
+			}
+			out = newOut;
+		}
+		memcpy(out + outUsed, entry == NULL ? start : entry, addLen);
+		outUsed += addLen;
+	}
+	if (out == NULL)
+		return 0;
+	out[outUsed] = '\0';
+	// Nothing but lone !s means nothing was replaced
+	if (strcmp(out, line) == 0) {
+		free(out);
+		return 0;
+	}
+	*expanded = out;
+	return 1;
+}
+
+long histFindPrefix(char* prefix, size_t len) {
+	uint32_t node = 0;
+	uint32_t child;
+	long i;
+	size_t depth;
+
+	// Nothing to find, and no trie (not even a root) to walk
+	if (numHistory == 0)
+		return -1;
+	// (Re)build the trie if there isn't one or it's mostly evicted entries by now
+	if (!histTrieBuilt || histTrieEvictions > histSize) {
+		histTrieReset();
+		histTrieBuilt = 1;
+		histTrieBase = histSeqBase;
+		for (i=0; i < numHistory; i++)
+			histTrieAdd(histSeqBase + i, histGet(i));
+	}
+	// Walk down as far as the trie goes
+	for (depth = 0; depth < len && depth < HIST_TRIE_DEPTH; depth++) {
+		for (child = histTrie[node].child; child != 0; child = histTrie[child].sibling) {
+			if (histTrie[child].c == (unsigned char)prefix[depth])
+				break;
+		}
+		if (child == 0)
+			return -1;
+		node = child;
+	}
+	// The newest entry under this node is the answer, unless it's been evicted since
+	// (then every entry under it has been too)
+	i = histTrie[node].latest + histTrieBase - histSeqBase;
+	if (i < 0)
+		return -1;
+	if (len <= HIST_TRIE_DEPTH)
+		return i;
+	// A prefix longer than the trie only matched its first bytes, so check the rest against
+	// just the distinct commands that go on past this node, newest entry of each
+	i = -1;
+	for (uint32_t t = histTrie[node].tails; t != 0; t = histTrieTails[t].next) {
+		long candidate = histTrieTails[t].latest + histTrieBase - histSeqBase;
+		if (candidate > i && strncmp(histGet(candidate), prefix, len) == 0)
+			i = candidate;
+	}
+	return i;
+}
+
+void histTrieAdd(long seq, char* cmd) {
+	uint32_t node = 0;
+	uint32_t child;
+	struct HistTrieNode* newTrie;
+	if (histTrieSize == 0) {
+		histTrie = (struct HistTrieNode*)malloc(sizeof(struct HistTrieNode) * 256);
+		if (histTrie == NULL) {
+			djsh_error();
+			exit(1);
+		}
+		histTrieSize = 256;
+		memset(&histTrie[0], 0, sizeof(struct HistTrieNode));  // the root
+		histTrieUsed = 1;
+	}
+	histTrie[0].latest = seq - histTrieBase;
+	for (size_t depth = 0; cmd[depth] != '\0' && depth < HIST_TRIE_DEPTH; depth++) {
+		for (child = histTrie[node].child; child != 0; child = histTrie[child].sibling) {
+			if (histTrie[child].c == (unsigned char)cmd[depth])
+				break;
+		}
+		if (child == 0) {
+			if (histTrieUsed == histTrieSize) {
+				newTrie = (struct HistTrieNode*)realloc(histTrie,
+					sizeof(struct HistTrieNode) * histTrieSize * 2);
+				if (newTrie == NULL) {
+					//perror("history trie realloc");
+					djsh_error();
+					exit(1);
+				}
+				histTrie = newTrie;
+				histTrieSize *= 2;
+			}
+			child = histTrieUsed++;
+			histTrie[child].c = (unsigned char)cmd[depth];
+			histTrie[child].tails = 0;
+			histTrie[child].child = 0;
+			histTrie[child].sibling = histTrie[node].child;
+			histTrie[node].child = child;
+		}
+		// Entries arrive oldest to newest, so this one is now the newest under every node it passes
+		histTrie[child].latest = seq - histTrieBase;
+		node = child;
+	}
+	if (strlen(cmd) > HIST_TRIE_DEPTH)
+		histTrieAddTail(node, seq, cmd);
+}
+
+void histTrieAddTail(uint32_t node, long seq, char* cmd) {
+	struct HistTrieTail* newTails;
+	uint32_t t;
+
+	// The same command again just moves its newest entry up
+	for (t = histTrie[node].tails; t != 0; t = histTrieTails[t].next) {
+		long i = histTrieTails[t].latest + histTrieBase - histSeqBase;
+		if (i >= 0 && i < numHistory && strcmp(histGet(i), cmd) == 0) {
+			histTrieTails[t].latest = seq - histTrieBase;
+			return;
+		}
+	}
+	if (histTrieTailsUsed == histTrieTailsSize) {
+		// Slot 0 stands for none, so it's never handed out
+		newTails = (struct HistTrieTail*)realloc(histTrieTails,
+			sizeof(struct HistTrieTail) * (histTrieTailsSize == 0 ? 256 : histTrieTailsSize * 2));
+		if (newTails == NULL) {
+			//perror("history trie tails realloc");
+			djsh_error();
+			exit(1);
+		}
+		histTrieTails = newTails;
+		histTrieTailsSize = histTrieTailsSize == 0 ? 256 : histTrieTailsSize * 2;
+		if (histTrieTailsUsed == 0)
+			histTrieTailsUsed = 1;
+	}
+	t = histTrieTailsUsed++;
+	histTrieTails[t].latest = seq - histTrieBase;
+	histTrieTails[t].next = histTrie[node].tails;
+	histTrie[node].tails = t;
+}
+
+void histTrieReset() {
+	free(histTrie);
+	histTrie = NULL;
+	free(histTrieTails);
+	histTrieTails = NULL;
+	histTrieTailsSize = 0;
+	histTrieTailsUsed = 0;
+	histTrieSize = 0;
+	histTrieUsed = 0;
+	histTrieBuilt = 0;
+	histTrieEvictions = 0;
+}
+
+uint32_t histIntern(char* cmd) {
+	size_t cmdLen = strlen(cmd);
+	size_t recSize = HIST_RECORD_SIZE(cmdLen);
+	uint32_t hash = hashString(cmd);
+	size_t slot;
+	size_t newSize;
+	char* newArena;
+	uint32_t off;
+	struct HistRecord* rec;
+
+	// Look for an existing record of this command, even one no entry uses right now
+	if (histLookupSize > 0) {
+		for (slot = hash & (histLookupSize-1); histLookup[slot] != HIST_NONE;
+				slot = (slot + 1) & (histLookupSize-1)) {
+			rec = HIST_RECORD(histLookup[slot]);
+			if (rec->hash == hash && rec->len == cmdLen
+				&& memcmp(cmd, (char*)rec + sizeof(struct HistRecord), cmdLen) == 0) {
+				if (rec->refs == 0)
+					histArenaDead -= recSize;
+				rec->refs++;
+				return histLookup[slot];
+			}
+		}
+	}
+
+	// New command, so make room for its record
+	if (histArenaUsed + recSize > histArenaSize) {
+		// Compacting only pays off once at least half the arena is dead,
+		// which keeps the copying O(1) per entry on average
+		if (histArenaDead >= histArenaUsed / 2)
+			histCompact();
+		if (histArenaUsed + recSize > histArenaSize) {
+			newSize = histArenaSize < 1024 ? 1024 : histArenaSize;
+			while (histArenaUsed + recSize > newSize && newSize <= HIST_ARENA_MAX / 2)
+				newSize *= 2;
+			// Once the arena can't grow, the dead records are all the room left,
+			// and if they aren't enough histAdd evicts entries until they are
+			if (histArenaUsed + recSize > newSize) {
+				if (histArenaUsed - histArenaDead + recSize > newSize)
+					return HIST_NONE;
+				histCompact();
+			}
+			if (newSize > histArenaSize) {
+				newArena = (char*)realloc(histArena, newSize);
+				if (newArena == NULL) {
+					//perror("history arena realloc");
+					djsh_error();
+					exit(1);
+				}
+				histArena = newArena;
+				histArenaSize = newSize;
+			}
+		}
+	}
+	off = histArenaUsed;
+	rec = HIST_RECORD(off);
+	rec->len = cmdLen;
+	rec->refs = 1;
+	rec->hash = hash;
+	memcpy((char*)rec + sizeof(struct HistRecord), cmd, cmdLen + 1);
+	histArenaUsed += recSize;
+	histNumRecords++;
+
+	// Keep the lookup table at most half full
+	if (histNumRecords * 2 > histLookupSize)
+		histRehash(histLookupSize < 64 ? 64 : histLookupSize * 2);
+	else {
+		for (slot = hash & (histLookupSize-1); histLookup[slot] != HIST_NONE;
+				slot = (slot + 1) & (histLookupSize-1));
+		histLookup[slot] = off;
+	}
+	return off;
+}
+
+void histRelease(uint32_t off) {
+	struct HistRecord* rec = HIST_RECORD(off);
+	rec->refs--;
+	if (rec->refs == 0)
+		histArenaDead += HIST_RECORD_SIZE(rec->len);
+}
+
+void histCompact() {
+	size_t newUsed = 0;
+	size_t recSize;
+	struct HistRecord* rec;
+	long slot;
+
+	// First work out where each record in use will end up, leaving it in the record's hash
+	for (size_t off = 0; off < histArenaUsed; off += recSize) {
+		rec = HIST_RECORD(off);
+		recSize = HIST_RECORD_SIZE(rec->len);
+		if (rec->refs > 0) {
+			rec->hash = newUsed;
+			newUsed += recSize;
+		}
+	}
+	// Then point every history entry at its record's new home
+	for (long i=0; i < numHistory; i++) {
+		slot = (histStart + i) % histRingSize;
+		histRing[slot] = HIST_RECORD(histRing[slot])->hash;
+	}
+	// Finally move the records, each only ever moves down past ones already handled
+	newUsed = 0;
+	histNumRecords = 0;
+	for (size_t off = 0; off < histArenaUsed; off += recSize) {
+		rec = HIST_RECORD(off);
+		recSize = HIST_RECORD_SIZE(rec->len);
+		if (rec->refs > 0) {
+			memmove(histArena + newUsed, rec, recSize);
+			rec = HIST_RECORD(newUsed);
+			rec->hash = hashString((char*)rec + sizeof(struct HistRecord));
+			newUsed += recSize;
+			histNumRecords++;
+		}
+	}
+	histArenaUsed = newUsed;
+	histArenaDead = 0;
+	histRehash(histLookupSize);
+}
+
+void histRehash(size_t newSize) {
+	size_t slot;
+	struct HistRecord* rec;
+	uint32_t* newLookup = (uint32_t*)realloc(histLookup, sizeof(uint32_t) * newSize);
+	if (newLookup == NULL) {
+		//perror("history lookup realloc");
+		djsh_error();
+		exit(1);
+	}
+	histLookup = newLookup;
+	histLookupSize = newSize;
+	memset(histLookup, 0xFF, sizeof(uint32_t) * newSize);  // every slot HIST_NONE
+	for (size_t off = 0; off < histArenaUsed; off += HIST_RECORD_SIZE(rec->len)) {
+		rec = HIST_RECORD(off);
+		for (slot = rec->hash & (newSize-1); histLookup[slot] != HIST_NONE;
+				slot = (slot + 1) & (newSize-1));
+		histLookup[slot] = off;
+	}
+}
+
+void histFileInit() {
+	char* setting = getenv("HISTFILE");
+	char* home;
+	struct stat st;
+	int fd;
+
+	if (setting != NULL) {
+		// An empty HISTFILE turns saving off
+		if (setting[0] == '\0')
+			return;
+		histFileName = strdup(setting);
+	} else {
+		home = getenv("HOME");
+		if (home == NULL)
+			return;
+		histFileName = (char*)malloc(sizeof(char) * (strlen(home) + strlen("/.djsh_history") + 1));
+		if (histFileName != NULL) {
+			strcpy(histFileName, home);
+			strcat(histFileName, "/.djsh_history");
+		}
+	}
+	if (histFileName == NULL) {
+		djsh_error();
+		exit(1);
+	}
+	atexit(histFileFlush);
+
+	// Just map it for now, so even a huge file costs nothing until history is needed
+	// The file only ever grows, so the mapping stays valid while the writer appends
+	fd = open(histFileName, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		histFileMap = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (histFileMap == MAP_FAILED)
+			histFileMap = NULL;
+		else
+			histFileMapSize = st.st_size;
+	}
+	close(fd);
+}
+
+void histRefresh() {
+	// A shared log stands in for the file, since it already holds every session's entries
+	if (sharedHist != NULL)
+		sharedHistSync();
+	else
+		histFileLoad();
+}
+
+void sharedHistInit() {
+	char* setting = getenv("DJSH_SHARED_HISTORY");
+	char* name;
+	size_t total = sizeof(struct SharedHistHeader) + SHARED_HIST_SIZE;
+	struct stat st;
+	void* map;
+	uint64_t tail;
+	uint64_t lapStart;
+	int fd;
+
+	if (setting == NULL || setting[0] == '\0')
+		return;
+	// Shared memory names start with a slash
+	name = (char*)malloc(sizeof(char) * (strlen(setting) + 2));
+	if (name == NULL) {
+		djsh_error();
+		exit(1);
+	}
+	strcpy(name, setting[0] == '/' ? "" : "/");
+	strcat(name, setting);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	free(name);
+	if (fd < 0) {
+		djsh_error();
+		return;
+	}
+	// Whoever gets here first sizes it, the zero fill is already an empty log
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size < total && ftruncate(fd, total) < 0)) {
+		djsh_error();
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		djsh_error();
+		return;
+	}
+	sharedHist = (struct SharedHistHeader*)map;
+	sharedHistData = (char*)map + sizeof(struct SharedHistHeader);
+	// Start from the oldest entry still in the log
+	tail = atomic_load(&sharedHist->tail);
+	lapStart = atomic_load(&sharedHist->lapStart);
+	sharedHistCursor = tail - lapStart <= SHARED_HIST_SIZE ? lapStart : tail;
+}
+
+void sharedHistAppend(char* cmd) {
+	size_t cmdLen = strlen(cmd);
+	uint64_t size = (sizeof(struct SharedHistRecord) + cmdLen + SHARED_HIST_ALIGN-1)
+		& ~(uint64_t)(SHARED_HIST_ALIGN-1);
+	uint64_t start;
+	uint64_t off;
+	struct SharedHistRecord* rec;
+
+	// Something this big would crowd out everyone else's history, so keep it local
+	if (size > SHARED_HIST_SIZE / 16) {
+		histAdd(cmd);
+		return;
+	}
+	while (1) {
+		// Claiming the bytes is the only step sessions contend on, and it's one atomic add
+		start = atomic_fetch_add(&sharedHist->tail, size);
+		off = start % SHARED_HIST_SIZE;
+		rec = (struct SharedHistRecord*)(sharedHistData + off);
+		rec->size = size;
+		if (off + size <= SHARED_HIST_SIZE) {
+			rec->len = cmdLen;
+			memcpy(rec + 1, cmd, cmdLen);
+			atomic_store_explicit(&rec->pos, start + 1, memory_order_release);
+			return;
+		}
+		// Records never wrap, so this claim becomes padding over the end and the next one
+		// starts the new lap (alignment guarantees there's room for the header)
+		rec->len = SHARED_HIST_PAD;
+		atomic_store(&sharedHist->lapStart, start + size);
+		atomic_store_explicit(&rec->pos, start + 1, memory_order_release);
+	}
 }
 
+void sharedHistSync() {
+	uint64_t tail;
+	uint64_t lapStart;
+	uint64_t off;
+	uint32_t size;
+	uint32_t cmdLen;
+	struct SharedHistRecord* rec;
+	char* buf = NULL;
+	size_t bufSize = 0;
+
+	if (sharedHist == NULL)
+		return;
+	tail = atomic_load_explicit(&sharedHist->tail, memory_order_acquire);
+	while (sharedHistCursor < tail) {
+		// Fell more than a lap behind, so what was at the cursor has been overwritten
+		if (tail - sharedHistCursor > SHARED_HIST_SIZE) {
+			lapStart = atomic_load(&sharedHist->lapStart);
+			sharedHistCursor = tail - lapStart <= SHARED_HIST_SIZE ? lapStart : tail;
+			continue;
+		}
+		off = sharedHistCursor % SHARED_HIST_SIZE;
+		rec = (struct SharedHistRecord*)(sharedHistData + off);
+		if (atomic_load_explicit(&rec->pos, memory_order_acquire) != sharedHistCursor + 1) {
+			// Claimed but not written yet, so pick it up next time, unless its writer
+			// seems to have died partway, in which case skip ahead to the newest entries
+			if (sharedHistStuckAt == sharedHistCursor && ++sharedHistStuckCount > 100)
+				sharedHistCursor = tail;
+			sharedHistStuckAt = sharedHistCursor;
+			break;
+		}
+		sharedHistStuckCount = 0;
+		size = rec->size;
+		cmdLen = rec->len;
+		if (size < sizeof(struct SharedHistRecord) || size % SHARED_HIST_ALIGN != 0) {
+			sharedHistCursor = tail;  // not a record we can make sense of
+			break;
+		}
+		if (cmdLen != SHARED_HIST_PAD) {
+			if (cmdLen > size - sizeof(struct SharedHistRecord))
+				cmdLen = size - sizeof(struct SharedHistRecord);
+			if (cmdLen + 1 > bufSize) {
+				bufSize = cmdLen + 1;
+				free(buf);
+				buf = (char*)malloc(bufSize);
+				if (buf == NULL) {
+					djsh_error();
+					exit(1);
+				}
+			}
+			memcpy(buf, rec + 1, cmdLen);
+			buf[cmdLen] = '\0';
+			// Only keep the copy if no writer lapped the log and reused these bytes meanwhile
+			tail = atomic_load_explicit(&sharedHist->tail, memory_order_acquire);
+			if (atomic_load_explicit(&rec->pos, memory_order_acquire) != sharedHistCursor + 1
+				|| tail - sharedHistCursor > SHARED_HIST_SIZE)
+				continue;
+			histAdd(buf);
+		}
+		sharedHistCursor += size;
+	}
+	free(buf);
+}
+
+void histFileLoad() {
+	char** session;
+	long numSession = numHistory;
+	long currentPos = histCurrentSeq - histSeqBase;  // Where the line being run is among this session's
+	int numRecords = 0;
+	int maxRecords = 0;
+	size_t* starts = NULL;
+	size_t end;
+	struct HistFileRecord rec;
+	char* cmd;
+	uint32_t cmdLen;
+	char* buf = NULL;
+	size_t bufSize = 0;
+
+	if (histFileLoaded)
+		return;
+	histFileLoaded = 1;
+	if (histFileMap == NULL)
+		return;
+
+	// Set this session's entries aside so the older ones from the file can go first
+	session = (char**)malloc(sizeof(char*) * (numSession + 1));
+	if (session == NULL) {
+		djsh_error();
+		exit(1);
+	}
+	for (long i=0; i < numSession; i++) {
+		session[i] = strdup(histGet(i));
+		if (session[i] == NULL) {
+			djsh_error();
+			exit(1);
+		}
+		histRelease(histRing[(histStart + i) % histRingSize]);
+	}
+	numHistory = 0;
+	histStart = 0;
+	histIndexReset();
+	histTrieReset();
+
+	// The file is only ever appended to, so rather than read through all of it, find just the
+	// newest records that will fit by working back from the end
+	end = histFileMapSize;
+	while (numRecords < histSize - numSession && histFilePrev(histFileMap, &end, &cmd, &cmdLen)) {
+		starts = (size_t*)growArray(starts, &maxRecords, numRecords + 1, sizeof(size_t));
+		starts[numRecords++] = end;
+	}
+	// Then add them oldest first
+	for (int i = numRecords-1; i >= 0; i--) {
+		memcpy(&rec, histFileMap + starts[i], sizeof(rec));
+		cmd = histFileMap + starts[i] + sizeof(rec);
+		cmdLen = rec.len;
+		// Records aren't null-terminated, so copy each one out first
+		if (cmdLen + 1 > bufSize) {
+			bufSize = cmdLen + 1;
+			free(buf);
+			buf = (char*)malloc(bufSize);
+			if (buf == NULL) {
+				djsh_error();
+				exit(1);
+			}
+		}
+		memcpy(buf, cmd, cmdLen);
+		buf[cmdLen] = '\0';
+		histAdd(buf);
+	}
+	free(buf);
+	free(starts);
+
+	for (long i=0; i < numSession; i++) {
+		histAdd(session[i]);
+		free(session[i]);
+	}
+	free(session);
+	// The file's entries now come first, so the line being run has moved along by that many
+	if (histCurrentSeq >= 0 && currentPos >= 0 && currentPos < numSession)
+		histCurrentSeq = histSeqBase + numHistory - numSession + currentPos;
+	munmap(histFileMap, histFileMapSize);
+	histFileMap = NULL;
+}
+
+int histFilePrev(char* map, size_t* end, char** cmd, uint32_t* cmdLen) {
+	struct HistFileRecord rec;
+	uint32_t crc;
+	size_t off;
+
+	if (*end < sizeof(rec))
+		return 0;
+	// Only the front of a record says how long it is, so step back a byte at a time to a magic
+	// that starts an intact record fitting before *end (skipping anything torn, eg by a crash)
+	for (off = *end - sizeof(rec); ; off--) {
+		memcpy(&rec, map + off, sizeof(rec));
+		if (rec.magic == HIST_FILE_MAGIC && rec.len <= *end - off - sizeof(rec)) {
+			crc = crc32Update(0, &rec.len, sizeof(rec.len));
+			crc = crc32Update(crc, map + off + sizeof(rec), rec.len);
+			if (crc == rec.crc) {
+				*cmd = map + off + sizeof(rec);
+				*cmdLen = rec.len;
+				*end = off;
+				return 1;
+			}
+		}
+		if (off == 0)
+			return 0;
+	}
+}
+
+void histFileAppend(char* cmd) {
+	struct HistFileRecord rec;
+	size_t needed;
+	size_t newSize;
+	char* newPending;
+
+	if (histFileName == NULL)
+		return;
+	rec.magic = HIST_FILE_MAGIC;
+	rec.len = strlen(cmd);
+	rec.crc = crc32Update(crc32Update(0, &rec.len, sizeof(rec.len)), cmd, rec.len);
+	needed = sizeof(rec) + rec.len;
+
+	pthread_mutex_lock(&histFileLock);
+	if (histFilePendingUsed + needed > histFilePendingSize) {
+		newSize = histFilePendingSize < 4096 ? 4096 : histFilePendingSize;
+		while (histFilePendingUsed + needed > newSize)
+			newSize *= 2;
+		newPending = (char*)realloc(histFilePending, newSize);
+		if (newPending == NULL) {
+			// Losing a saved entry beats losing the shell
+			pthread_mutex_unlock(&histFileLock);
+			djsh_error();
+			return;
+		}
+		histFilePending = newPending;
+		histFilePendingSize = newSize;
+	}
+	memcpy(histFilePending + histFilePendingUsed, &rec, sizeof(rec));
+	memcpy(histFilePending + histFilePendingUsed + sizeof(rec), cmd, rec.len);
+	histFilePendingUsed += needed;
+	pthread_cond_signal(&histFileCond);
+	pthread_mutex_unlock(&histFileLock);
+
+	// The writer only starts once there's something to write
+	if (!histFileWriterRunning) {
+		if (pthread_create(&histFileWriterThread, NULL, histFileWriter, NULL) == 0)
+			histFileWriterRunning = 1;
+	}
+}
+
+void* histFileWriter(void* unused) {
+	char* batch = NULL;
+	size_t batchSize = 0;
+	size_t batchUsed;
+	char* swap;
+	size_t swapSize;
+	ssize_t written;
+	int fd = open(histFileName, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+	pthread_mutex_lock(&histFileLock);
+	while (1) {
+		while (histFilePendingUsed == 0 && !histFileStopping)
+			pthread_cond_wait(&histFileCond, &histFileLock);
+		if (histFilePendingUsed == 0)
+			break;  // stopping, and nothing left to write
+		// Swap buffers so the shell can keep queueing while this batch is written
+		swap = batch;
+		batch = histFilePending;
+		histFilePending = swap;
+		swapSize = batchSize;
+		batchSize = histFilePendingSize;
+		histFilePendingSize = swapSize;
+		batchUsed = histFilePendingUsed;
+		histFilePendingUsed = 0;
+		pthread_mutex_unlock(&histFileLock);
+
+		// Whole records in one append, so sessions sharing the file don't interleave mid-record
+		if (fd >= 0) {
+			for (size_t off = 0; off < batchUsed; off += written) {
+				written = write(fd, batch + off, batchUsed - off);
+				if (written <= 0)
+					break;
+			}
+			fdatasync(fd);
+		}
+
+		pthread_mutex_lock(&histFileLock);
+	}
+	pthread_mutex_unlock(&histFileLock);
+	free(batch);
+	if (fd >= 0)
+		close(fd);
+	return unused;
+}
+
+void histFileFlush() {
+	if (!histFileWriterRunning)
+		return;
+	pthread_mutex_lock(&histFileLock);
+	histFileStopping = 1;
+	pthread_cond_signal(&histFileCond);
+	pthread_mutex_unlock(&histFileLock);
+	pthread_join(histFileWriterThread, NULL);
+	histFileWriterRunning = 0;
+}
+
+uint32_t crc32Update(uint32_t crc, const void* buf, size_t len) {
+	static uint32_t table[256];
+	static int tableReady = 0;
+	const unsigned char* bytes = (const unsigned char*)buf;
+	uint32_t c;
+	// Build the byte-at-a-time lookup table on first use
+	if (!tableReady) {
+		for (uint32_t i=0; i < 256; i++) {
+			c = i;
+			for (int j=0; j < 8; j++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		tableReady = 1;
+	}
+	crc = ~crc;
+	for (size_t i=0; i < len; i++)
+		crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+unsigned int hashString(char* str) {
+	// djb2 string hash
+	unsigned int h = 5381;
+	for (int i=0; str[i] != '\0'; i++)
+		h = h * 33 + (unsigned char)str[i];
+	return h;
+}
+
+unsigned int hashName(char* name) {
+	return hashString(name) % HASH_BUCKETS;
+}
+
+int buildPathIndex() {
+	char buf[8192];
+	long nread;
+	int dirFd;
+	int wd;
+	struct dirent64* dent;
+	struct IndexEntry* entry;
+	unsigned int bucket;
+	struct stat st;
+
+	invalidatePathIndex();
+	// Watch before reading, so nothing that changes mid-scan goes unnoticed
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0) {
+		indexFailed = 1;
+		return 0;
+	}
+	for (int i=0; i < numPathDirs; i++) {
+		if (pathDirs[i].fd < 0)
+			pathDirs[i].fd = open(pathDirs[i].name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		// A missing directory counts as empty until it turns up
+		if (pathDirs[i].fd < 0)
+			continue;
+		// As does one that can't be looked at, its mtime being zero so it isn't seen as changed
+		if (fstat(pathDirs[i].fd, &st) < 0) {
+			pathDirs[i].mtime = (struct timespec){0};
+			continue;
+		}
+		pathDirs[i].mtime = st.st_mtim;
+		wd = inotify_add_watch(inotifyFd, pathDirs[i].name,
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+				| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		dirFd = openat(pathDirs[i].fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (wd < 0 || dirFd < 0) {
+			// Can't keep this one fresh (eg out of watches), so don't trust the index
+			if (dirFd >= 0)
+				close(dirFd);
+			invalidatePathIndex();
+			indexFailed = 1;
+			return 0;
+		}
+		// Read the directory in big batches straight from the kernel
+		while ((nread = getdents64(dirFd, buf, sizeof(buf))) > 0) {
+			for (long off = 0; off < nread; off += dent->d_reclen) {
+				dent = (struct dirent64*)(buf + off);
+				if (dent->d_type == DT_DIR || strcmp(dent->d_name, ".") == 0
+					|| strcmp(dent->d_name, "..") == 0)
+					continue;
+				// Earlier directories win, same as a search in path order
+				bucket = hashString(dent->d_name) % INDEX_BUCKETS;
+				for (entry = pathIndex[bucket]; entry != NULL; entry = entry->next) {
+					if (strcmp(entry->name, dent->d_name) == 0)
+						break;
+				}
+				if (entry != NULL || !isExecutable(pathDirs[i].fd, dent->d_name, dent->d_type))
+					continue;
+				entry = (struct IndexEntry*)malloc(sizeof(struct IndexEntry));
+				if (entry == NULL) {
+					//perror("index entry malloc");
+					djsh_error();
+					exit(1);
+				}
+				entry->name = (char*)malloc(sizeof(char) * (strlen(dent->d_name)+1));
+				if (entry->name == NULL) {
+					djsh_error();
+					exit(1);
+				}
+				strcpy(entry->name, dent->d_name);
+				entry->dir = i;
+				entry->next = pathIndex[bucket];
+				pathIndex[bucket] = entry;
+			}
+		}
+		close(dirFd);
+	}
+	// The mtimes were all just read
+	clock_gettime(CLOCK_MONOTONIC, &pathCheckedAt);
+	indexValid = 1;
+	return 1;
+}
+
+void syncPathIndex() {
+	char buf[4096];
+	int changed = 0;
+	if (inotifyFd < 0)
+		return;
+	// Drain every queued event, any one of them (or an overflow) means the index is stale
+	while (read(inotifyFd, buf, sizeof(buf)) > 0)
+		changed = 1;
+	if (changed) {
+		invalidatePathIndex();
+		// Remembered locations may be stale too
+		hashClear(1);
+	}
+}
+
+void invalidatePathIndex() {
+	struct IndexEntry* entry;
+	for (int i=0; i < INDEX_BUCKETS; i++) {
+		while (pathIndex[i] != NULL) {
+			entry = pathIndex[i];
+			pathIndex[i] = entry->next;
+			free(entry->name);
+			free(entry);
+		}
+	}
+	if (inotifyFd >= 0)
+		close(inotifyFd);
+	inotifyFd = -1;
+	indexValid = 0;
+}
+
+int pathDirsChanged() {
+	struct stat st;
+	struct timespec now;
+
+	// On a slow mount every look costs a round trip per directory, so a burst of misses only pays once
+	// (clock_gettime is answered in the vDSO, without entering the kernel)
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - pathCheckedAt.tv_sec) * 1000 + (now.tv_nsec - pathCheckedAt.tv_nsec) / 1000000
+		< PATH_RECHECK_MS)
+		return 0;
+	pathCheckedAt = now;
+	for (int i=0; i < numPathDirs; i++) {
+		if (pathDirs[i].fd < 0) {
+			pathDirs[i].fd = open(pathDirs[i].name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+			if (pathDirs[i].fd >= 0)
+				return 1;
+			continue;
+		}
+		// One that still can't be looked at compares as zero, same as when it was indexed
+		if (fstat(pathDirs[i].fd, &st) < 0)
+			st.st_mtim = (struct timespec){0};
+		if (st.st_mtim.tv_sec != pathDirs[i].mtime.tv_sec || st.st_mtim.tv_nsec != pathDirs[i].mtime.tv_nsec)
+			return 1;
+	}
+	return 0;
+}
+
+int isExecutable(int dirFd, char* name, unsigned char type) {
+	struct stat st;
+	// Links (and filesystems that don't give a type) need a look at what they really are
+	if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+		return 0;
+	if (type != DT_REG && (fstatat(dirFd, name, &st, 0) < 0 || !S_ISREG(st.st_mode)))
+		return 0;
+	return faccessat(dirFd, name, X_OK, 0) == 0;
+}
+
+struct IndexEntry* pathIndexFind(char* cmd) {
+	struct IndexEntry* entry = pathIndex[hashString(cmd) % INDEX_BUCKETS];
+	while (entry != NULL && strcmp(entry->name, cmd) != 0)
+		entry = entry->next;
+	return entry;
+}
+
+char* hashLookup(char* cmd) {
+	struct HashEntry* entry;
+	char* cmdPath;
+	// Commands with a slash (eg "/bin/ls" or "./a.out") name the file directly,
+	// so there's nothing to search for or remember
+	if (strchr(cmd, '/') != NULL)
+		return access(cmd, X_OK) == 0 ? cmd : NULL;
+	// Pick up any changes to the path's directories before trusting what's remembered
+	syncPathIndex();
+	// Only load the bucket now, since the sync may have just emptied it
+	entry = hashTable[hashName(cmd)];
+	// Walk the bucket looking for a remembered location
+	while (entry != NULL) {
+		if (strcmp(entry->name, cmd) == 0) {
+			entry->hits++;
+			return entry->cmdPath;
+		}
+		entry = entry->next;
+	}
+	// Not remembered yet, so search the path and remember the result
+	cmdPath = checkPath(cmd);
+	if (cmdPath == NULL)
+		return NULL;
+	hashInsert(cmd, cmdPath, 0);
+	free(cmdPath);  // hashInsert keeps its own copy
+	entry = hashTable[hashName(cmd)];
+	entry->hits++;
+	return entry->cmdPath;
+}
+
+void hashInsert(char* name, char* cmdPath, int pinned) {
+	unsigned int bucket = hashName(name);
+	struct HashEntry* entry = hashTable[bucket];
+	// Reuse an existing entry for this name if there is one
+	while (entry != NULL && strcmp(entry->name, name) != 0)
+		entry = entry->next;
+	if (entry == NULL) {
+		entry = (struct HashEntry*)malloc(sizeof(struct HashEntry));
+		if (entry == NULL) {
+			//perror("hash entry malloc");
+			djsh_error();
+			exit(1);
+		}
+		entry->name = (char*)malloc(sizeof(char) * (strlen(name)+1));
+		if (entry->name == NULL) {
+			djsh_error();
+			exit(1);
+		}
+		strcpy(entry->name, name);
+		// New entries go at the front of the bucket
+		entry->next = hashTable[bucket];
+		hashTable[bucket] = entry;
+	} else {
+		free(entry->cmdPath);
+	}
+	entry->cmdPath = (char*)malloc(sizeof(char) * (strlen(cmdPath)+1));
+	if (entry->cmdPath == NULL) {
+		djsh_error();
+		exit(1);
+	}
+	strcpy(entry->cmdPath, cmdPath);
+	entry->hits = 0;
+	entry->pinned = pinned;
+}
+
+void hashClear(int keepPinned) {
+	struct HashEntry** link;
+	struct HashEntry* entry;
+	for (int i=0; i < HASH_BUCKETS; i++) {
+		// link is whatever points at the current entry, so it can be unlinked in place
+		link = &hashTable[i];
+		while (*link != NULL) {
+			entry = *link;
+			if (keepPinned && entry->pinned) {
+				link = &entry->next;
+			} else {
+				*link = entry->next;
+				free(entry->name);
+				free(entry->cmdPath);
+				free(entry);
+			}
+		}
+	}
+}
+
+void hashPrint() {
+	char hits[16];
+	struct HashEntry* entry;
+	for (int i=0; i < HASH_BUCKETS; i++) {
+		for (entry = hashTable[i]; entry != NULL; entry = entry->next) {
+			// Pinned entries never went through a search, so show a dash like bash does
+			if (entry->pinned)
+				snprintf(hits, sizeof(hits), "%4s\t", "-");
+			else
+				snprintf(hits, sizeof(hits), "%4d\t", entry->hits);
+			write(STDOUT_FILENO, hits, strlen(hits));
+			write(STDOUT_FILENO, entry->name, strlen(entry->name));
+			write(STDOUT_FILENO, "\t", sizeof(char));
+			write(STDOUT_FILENO, entry->cmdPath, strlen(entry->cmdPath));
+			write(STDOUT_FILENO, "\n", sizeof(char));
+		}
+	}
+}
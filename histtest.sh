@@ -0,0 +1,35 @@
+#!/bin/sh
+# histtest.sh
+# Checks djsh's history against a history file left by an earlier session.
+# Run with "make test", which builds djsh first
+
+djsh=${DJSH:-./djsh}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# Run djsh on the lines given, with history saved to the test's file
+run() {
+	printf "$1" | HISTFILE="$dir/history" DJSH_SHARED_HISTORY= "$djsh" 2>&1
+}
+
+# Fail the test named $1 unless the output $2 has the line $3
+expect() {
+	if ! printf '%s\n' "$2" | grep -qxF -- "$3"; then
+		echo "FAIL: $1: expected \"$3\" in:"
+		printf '%s\n' "$2"
+		failed=1
+	fi
+}
+
+run 'echo foo1\necho foo2\n' > /dev/null
+
+# The first history -r of a session loads the file, and must still skip only its own line
+out=$(run 'history -r foo\n')
+expect "history -r after loading the file" "$out" "djsh> echo foo2"
+
+out=$(run 'history\n')
+expect "file entries listed first" "$out" "djsh> echo foo1"
+
+[ $failed -eq 0 ] && echo "histtest: all passed"
+exit $failed
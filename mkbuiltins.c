@@ -0,0 +1,51 @@
+/*
+ * mkbuiltins.c
+ * Build-time generator for builtin_hash.h: a perfect hash of the built-in names in builtins.h.
+ * Tries table sizes from the smallest power of two that fits, and seeds for each, until every
+ * name lands in its own slot, then prints the seed and the slot table.
+ * Run by the Makefile as "./mkbuiltins > builtin_hash.h"
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "builtins.h"
+
+#define NAME(name, handler, minArgs, maxArgs, changesState) name,
+const char* names[] = {DJSH_BUILTINS(NAME)};
+#undef NAME
+#define NUM_NAMES ((int)(sizeof(names) / sizeof(names[0])))
+
+int main() {
+	signed char slots[256];
+	int bits = 0;
+
+	while ((1 << bits) < NUM_NAMES)
+		bits++;
+	for (; bits <= 8; bits++) {
+		int size = 1 << bits;
+		for (uint32_t seed = 0; seed < 1000000; seed++) {
+			int collided = 0;
+			memset(slots, -1, sizeof(slots));
+			for (int i=0; i < NUM_NAMES && !collided; i++) {
+				uint32_t slot = builtinNameHash(names[i], seed) & (size - 1);
+				if (slots[slot] >= 0)
+					collided = 1;
+				else
+					slots[slot] = i;
+			}
+			if (collided)
+				continue;
+			printf("// Generated by mkbuiltins from builtins.h, do not edit\n");
+			printf("#define BUILTIN_HASH_SEED %uu\n", seed);
+			printf("#define BUILTIN_TABLE_BITS %d\n", bits);
+			printf("// Index into builtins[] for each slot, -1 for an empty one\n");
+			printf("static const signed char builtinSlots[%d] = {", size);
+			for (int i=0; i < size; i++)
+				printf("%s%d,", i % 16 == 0 ? "\n\t" : " ", slots[i]);
+			printf("\n};\n");
+			return 0;
+		}
+	}
+	fprintf(stderr, "mkbuiltins: no perfect hash found\n");
+	return 1;
+}